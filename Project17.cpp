@@ -1,466 +1,5278 @@
-#define _CRT_SECURE_NO_WARNINGS
-
-#include <iostream>
-#include <fstream>
-#include <sstream>
-#include <string>
-#include <vector>
-#include <algorithm>
-#include <map>
-#include <set>
-#include <chrono>
-#include <filesystem>
-#include "csv.h"
-
-
-using namespace std;
-namespace fs = std::filesystem;
-
-struct Video {
-    string video_id;
-    string country;
-    string trending_date;
-    string title;
-    string channel_title;
-    int category_id;
-    string publish_time;
-    string tags;
-    string temp_comments_disabled;
-    string temp_ratings_disabled;
-    string temp_video_error_or_removed;
-    int views;
-    int likes;
-    int dislikes;
-    int comment_count;
-    string thumbnail_link;
-    int comments_disabled;
-    int ratings_disabled;
-    int video_error_or_removed;
-    string description;
-};
-
-//calculates the engagement rate of a video
-double engagementRate(const Video& video) {
-    double likeWeight = 1.0;
-    double dislikeWeight = 0.5;
-    double commentWeight = 1.5;
-
-    double totalLikes = likeWeight * video.likes;
-    double totalDislikes = dislikeWeight * video.dislikes;
-    double totalComments = commentWeight * video.comment_count;
-
-    return (totalLikes + totalDislikes + totalComments) / video.views;
-}
-//validates and converts the user input for countries
-vector<string> validateAndConvertCountryInput(const string& input, const set<string>& valid_countries) {
-    string uppercaseInput = input;
-    transform(input.begin(), input.end(), uppercaseInput.begin(), ::toupper);
-    stringstream ss(uppercaseInput);
-    string token;
-    vector<string> result;
-
-    while (getline(ss, token, ',')) {
-        token.erase(remove(token.begin(), token.end(), ' '), token.end());
-        if (valid_countries.count(token) > 0 || token == "ALL") {
-            result.push_back(token);
-        }
-        else {
-            return {}; // Invalid input, return an empty vector
-        }
-    }
-
-    return result;
-}
-//splits the video tags into a vector of tags
-vector<string> splitTags(const string& tags) {
-    stringstream ss(tags);
-    string tag;
-    vector<string> tagList;
-
-    while (getline(ss, tag, '|')) {
-        tagList.push_back(tag);
-    }
-
-    return tagList;
-}
-//checks if a string is ASCII
-bool isAscii(const std::string& s) {
-    return std::all_of(s.begin(), s.end(), [](char c) { return static_cast<unsigned char>(c) < 128; });
-}
-
-map<string, map<string, int>> countryTagViews;
-map<string, map<string, int>> countryTagInteractions;
-map<string, int> globalTagViews;
-map<string, int> globalTagInteraction;
-
-void updateTagViewsAndInteractions(const Video& video) {
-    double engagement = engagementRate(video);
-    const auto& tags = splitTags(video.tags);
-    for (const string& tag : tags) {
-        if (isAscii(tag)) {
-            int tagViews = video.views;
-            double weightedEngagement = engagement * tagViews;
-
-            countryTagViews[video.country][tag] += tagViews;
-            countryTagInteractions[video.country][tag] += weightedEngagement;
-            globalTagViews[tag] += tagViews;
-            globalTagInteraction[tag] += weightedEngagement;
-        }
-    }
-}
-
-struct TreeNode {
-    string key;
-    int value;
-    TreeNode* left;
-    TreeNode* right;
-
-    TreeNode(string key, int value) : key(key), value(value), left(nullptr), right(nullptr) {}
-    size_t size() const {
-        size_t leftSize = left ? left->size() : 0;
-        size_t rightSize = right ? right->size() : 0;
-        return 1 + leftSize + rightSize;
-    }
-};
-
-TreeNode* insertNode(TreeNode* root, const string& key, int value) {
-    if (root == nullptr) {
-        return new TreeNode(key, value);
-    }
-
-    if (key < root->key) {
-        root->left = insertNode(root->left, key, value);
-    }
-    else if (key > root->key) {
-        root->right = insertNode(root->right, key, value);
-    }
-    else {
-        root->value += value;
-    }
-
-    return root;
-}
-
-TreeNode* searchNode(TreeNode* root, const string& key) {
-    if (root == nullptr || root->key == key) {
-        return root;
-    }
-
-    if (key < root->key) {
-        return searchNode(root->left, key);
-    }
-
-    return searchNode(root->right, key);
-}
-
-void updateTagViewsAndInteractionsBST(const Video& video, TreeNode*& countryTagViewsRoot, TreeNode*& countryTagInteractionsRoot, TreeNode*& globalTagViewsRoot, TreeNode*& globalTagInteractionRoot) {
-    double engagement = engagementRate(video);
-    const auto& tags = splitTags(video.tags);
-    for (const string& tag : tags) {
-        if (isAscii(tag)) {
-            int tagViews = video.views;
-            double weightedEngagement = engagement * tagViews;
-
-            TreeNode* countryNode = searchNode(countryTagViewsRoot, tag);
-            if (countryNode) {
-                countryNode->value += tagViews;
-            }
-            else {
-                countryTagViewsRoot = insertNode(countryTagViewsRoot, tag, tagViews);
-            }
-
-            TreeNode* countryInteractionNode = searchNode(countryTagInteractionsRoot, tag);
-            if (countryInteractionNode) {
-                countryInteractionNode->value += weightedEngagement;
-            }
-            else {
-                countryTagInteractionsRoot = insertNode(countryTagInteractionsRoot, tag, weightedEngagement);
-            }
-
-            TreeNode* globalNode = searchNode(globalTagViewsRoot, tag);
-            if (globalNode) {
-                globalNode->value += tagViews;
-            }
-            else {
-                globalTagViewsRoot = insertNode(globalTagViewsRoot, tag, tagViews);
-            }
-
-            TreeNode* globalInteractionNode = searchNode(globalTagInteractionRoot, tag);
-            if (globalInteractionNode) {
-                globalInteractionNode->value += weightedEngagement;
-            }
-            else {
-                globalTagInteractionRoot = insertNode(globalTagInteractionRoot, tag, weightedEngagement);
-            }
-        }
-    }
-}
-
-void inOrderTraversal(TreeNode* root, vector<pair<string, int>>& result) {
-    if (root == nullptr) {
-        return;
-    }
-
-    inOrderTraversal(root->left, result);
-    result.push_back(make_pair(root->key, root->value));
-    inOrderTraversal(root->right, result);
-}
-
-
-vector<pair<string, int>> topNElements(const map<string, int>& m, size_t n) {
-    vector<pair<string, int>> topElements;
-    for (const auto& entry : m) {
-        topElements.push_back(entry);
-    }
-
-    sort(topElements.begin(), topElements.end(), [](const auto& a, const auto& b) {
-        return a.second > b.second;
-        });
-
-    if (topElements.size() > n) {
-        topElements.resize(n);
-    }
-
-    return topElements;
-}
-
-vector<pair<string, int>> topNElementsFromBST(TreeNode* root, size_t n) {
-    vector<pair<string, int>> elements;
-    inOrderTraversal(root, elements);
-
-    sort(elements.begin(), elements.end(), [](const auto& a, const auto& b) {
-        return a.second > b.second;
-        });
-
-    if (elements.size() > n) {
-        elements.resize(n);
-    }
-
-    return elements;
-}
-
-vector<string> split(const string& str, char delimiter) {
-    vector<string> result;
-    stringstream ss(str);
-    string item;
-
-    while (getline(ss, item, delimiter)) {
-        result.push_back(item);
-    }
-
-    return result;
-}
-
-void trim(string& str) {
-    size_t first = str.find_first_not_of(' ');
-    if (first == string::npos) {
-        str = "";
-        return;
-    }
-    size_t last = str.find_last_not_of(' ');
-    str = str.substr(first, last - first + 1);
-}
-
-void printElements(const vector<pair<string, int>>& elements) {
-    for (const auto& element : elements) {
-        cout << element.first << ": " << element.second << "\n";
-    }
-}
-
-
-
-
-int main() {
-    string foldername = "archive"; // Replace with the name of the folder containing the dataset files
-    vector<Video> videos;
-
-    cout << "Choose a data structure for parsing (map or bst): ";
-    string dataStructure;
-    getline(cin, dataStructure);
-    transform(dataStructure.begin(), dataStructure.end(), dataStructure.begin(), ::tolower);
-
-    while (dataStructure != "map" && dataStructure != "bst") {
-        cout << "Please choose a valid data structure (map or bst): ";
-        getline(cin, dataStructure);
-        transform(dataStructure.begin(), dataStructure.end(), dataStructure.begin(), ::tolower);
-    }
-
-    auto start = chrono::high_resolution_clock::now();
-
-    TreeNode* countryTagViewsRoot = nullptr;
-    TreeNode* countryTagInteractionsRoot = nullptr;
-    TreeNode* globalTagViewsRoot = nullptr;
-    TreeNode* globalTagInteractionRoot = nullptr;
-
-    for (const auto& entry : fs::directory_iterator(foldername)) {
-        if (entry.path().extension() == ".csv") {
-            string filename = entry.path().filename().string();
-            string default_country = filename.substr(0, 2);
-            try {
-                io::CSVReader<16, io::trim_chars<' ', '\t'>, io::double_quote_escape<',', '\"'>> in(entry.path().string());
-                in.read_header(io::ignore_extra_column, "video_id", "trending_date", "title", "channel_title",
-                    "category_id", "publish_time", "tags", "views", "likes", "dislikes", "comment_count",
-                    "thumbnail_link", "comments_disabled", "ratings_disabled", "video_error_or_removed", "description");
-
-                Video video;
-                try {
-                    while (in.read_row(video.video_id, video.trending_date, video.title, video.channel_title,
-                        video.category_id, video.publish_time, video.tags, video.views, video.likes, video.dislikes,
-                        video.comment_count, video.thumbnail_link, video.temp_comments_disabled, video.temp_ratings_disabled,
-                        video.temp_video_error_or_removed, video.description)) {
-
-                        video.comments_disabled = (video.temp_comments_disabled == "True");
-                        video.ratings_disabled = (video.temp_ratings_disabled == "True");
-                        video.video_error_or_removed = (video.temp_video_error_or_removed == "True");
-                        video.country = default_country;
-                        videos.push_back(video);
-
-                        if (dataStructure == "map") {
-                            updateTagViewsAndInteractions(video);
-                        }
-                        else {
-                            updateTagViewsAndInteractionsBST(video, countryTagViewsRoot, countryTagInteractionsRoot, globalTagViewsRoot, globalTagInteractionRoot);
-                        }
-                    }
-                }
-                catch (const std::exception& e) {
-                    cerr << "Error parsing a line in file " << entry.path() << ": " << e.what() << "\n";
-                    continue;
-                }
-
-            }
-            catch (const std::exception& e) {
-                cerr << "Error parsing file " << entry.path() << ": " << e.what() << "\n";
-                continue;
-            }
-        }
-    }
-
-
-    auto end = chrono::high_resolution_clock::now();
-    auto duration = chrono::duration_cast<chrono::milliseconds>(end - start).count();
-
-    cout << "Time taken to parse data using " << dataStructure << ": " << duration << " milliseconds" << "\n";
-
-    set<string> countries;
-    for (const Video& video : videos) {
-        countries.insert(video.country);
-    }
-
-    cout << "Available countries: ";
-    for (const string& country : countries) {
-        cout << country << " ";
-    }
-    cout << "\n";
-
-    bool validInput = false;
-    vector<string> selectedCountries;
-
-    while (!validInput) {
-        cout << "Select countries (use comma-separated values): ";
-        string input;
-        getline(cin, input);
-
-        selectedCountries = split(input, ',');
-        for (string& country : selectedCountries) {
-            trim(country);
-            if (countries.find(country) != countries.end()) {
-                validInput = true;
-            }
-            else {
-                cout << "Invalid country code: " << country << "\n";
-                validInput = false;
-                break;
-            }
-        }
-    }
-
-
-
-    // Convert the vector to a set
-    set<string> selectedCountriesSet(selectedCountries.begin(), selectedCountries.end());
-
-    for (const string& country : selectedCountries) {
-
-        cout << "                                                       " << "\n";
-        cout << "                                                       " << "\n";
-        cout << "                                                       " << "\n";
-        cout << "\nCountry: " << country << "\n";
-
-        // Top 25 keywords/tags for views
-        if (dataStructure == "map") {
-            auto topViews = topNElements(countryTagViews[country], 25);
-            cout << "Top 25 keywords/tags for views:" << "\n";
-            printElements(topViews);
-        }
-        else {
-            auto topViews = topNElementsFromBST(countryTagViewsRoot, 25);
-            cout << "Top 25 keywords/tags for views:" << "\n";
-            printElements(topViews);
-        }
-
-        // Top 25 keywords/tags to avoid for views
-        if (dataStructure == "map") {
-            auto bottomViews = topNElements(countryTagViews[country], countryTagViews[country].size());
-            reverse(bottomViews.begin(), bottomViews.end());
-            bottomViews.resize(25);
-            cout << "                                                       " << "\n";
-            cout << "                                                       " << "\n";
-            cout << "                                                       " << "\n";
-            cout << "Top 25 keywords/tags to avoid for views:" << "\n";
-            printElements(bottomViews);
-        }
-        else {
-            auto bottomViews = topNElementsFromBST(countryTagViewsRoot, countryTagViewsRoot->size());
-            reverse(bottomViews.begin(), bottomViews.end());
-            bottomViews.resize(25);
-            cout << "                                                       " << "\n";
-            cout << "                                                       " << "\n";
-            cout << "                                                       " << "\n";
-            cout << "Top 25 keywords/tags to avoid for views:" << "\n";
-            printElements(bottomViews);
-        }
-
-        // Top 25 keywords/tags for positive interaction
-        if (dataStructure == "map") {
-            auto topInteraction = topNElements(countryTagInteractions[country], 25);
-            cout << "                                                       " << "\n";
-            cout << "                                                       " << "\n";
-            cout << "                                                       " << "\n";
-            cout << "Top 25 keywords/tags for positive interaction:" << "\n";
-            printElements(topInteraction);
-        }
-        else {
-            auto topInteraction = topNElementsFromBST(countryTagInteractionsRoot, 25);
-            cout << "                                                       " << "\n";
-            cout << "                                                       " << "\n";
-            cout << "                                                       " << "\n";
-            cout << "Top 25 keywords/tags for positive interaction:" << "\n";
-            printElements(topInteraction);
-        }
-
-        // Top 25 keywords/tags to avoid for positive interaction
-        if (dataStructure == "map") {
-            auto bottomInteraction = topNElements(countryTagInteractions[country], countryTagInteractions[country].size());
-            reverse(bottomInteraction.begin(), bottomInteraction.end());
-            bottomInteraction.resize(25);
-            cout << "                                                       " << "\n";
-            cout << "                                                       " << "\n";
-            cout << "                                                       " << "\n";
-            cout << "Top 25 keywords/tags to avoid for positive interaction:" << "\n";
-            printElements(bottomInteraction);
-        }
-        else {
-            auto bottomInteraction = topNElementsFromBST(countryTagInteractionsRoot, countryTagInteractionsRoot->size());
-            reverse(bottomInteraction.begin(), bottomInteraction.end());
-            bottomInteraction.resize(25);
-            cout << "                                                       " << "\n";
-            cout << "                                                       " << "\n";
-            cout << "                                                       " << "\n";
-            cout << "Top 25 keywords/tags to avoid for positive interaction:" << "\n";
-            printElements(bottomInteraction);
-        }
-    }
-
-    return 0;
-}
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <memory_resource>
+#include <tuple>
+#include <set>
+#include <iterator>
+#include <deque>
+#include <unordered_map>
+#include <string_view>
+#include <thread>
+#include <cstdint>
+#include <chrono>
+#include <filesystem>
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <mutex>
+#include <iomanip>
+#include <queue>
+#include <cmath>
+#include <climits>
+#include <charconv>
+#include <type_traits>
+#include <numeric>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#define PROJECT17_X86 1
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PROJECT17_SSE2 1
+#endif
+#endif
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+//                             Instrumentation                            //
+////////////////////////////////////////////////////////////////////////////
+
+//counters and scoped timers on the hot paths, including the ones csv.h exposes through its
+//CSV_IO_TRACE_* hooks. Nothing is recorded until --trace turns it on, and defining
+//PROJECT17_NO_INSTRUMENTATION compiles all of it out. Every thread adds to its own slots;
+//timed scopes that take at least traceEventMinNanos are also kept as Chrome trace events.
+//Defined before csv.h is included, so it spells out std::.
+#ifndef PROJECT17_NO_INSTRUMENTATION
+const std::int64_t traceEventMinNanos = 20000;
+
+//a place in the code that is timed or counted; sites with the same name are reported together
+struct TraceSite {
+    TraceSite(const char* name, bool timed);
+
+    const char* name;
+    bool timed;
+    int id; // -1 once all slots are taken
+};
+
+struct TraceEvent {
+    int site;
+    std::int64_t beginNanos;
+    std::int64_t durationNanos;
+};
+
+//values taken at one moment, such as the resident memory after a phase; written to the Chrome
+//trace as a counter event
+struct TraceSample {
+    std::string name;
+    std::int64_t nanos;
+    std::vector<std::pair<std::string, double>> values;
+};
+
+//what one thread recorded. Only the thread itself writes its slots, the relaxed atomics let
+//the summary read them while it runs
+struct ThreadTrace {
+    static const int maxSites = 128;
+    static const std::size_t maxEvents = 1 << 20;
+
+    int id = 0;
+    std::atomic<std::uint64_t> calls[maxSites] = {};
+    std::atomic<std::uint64_t> totals[maxSites] = {}; // nanoseconds of a timer, amount of a counter
+    std::mutex eventsMutex;
+    std::vector<TraceEvent> events;
+
+    static void add(std::atomic<std::uint64_t>& slot, std::uint64_t amount) {
+        slot.store(slot.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+};
+
+struct TraceRegistry {
+    std::atomic<bool> enabled{ false };
+    std::chrono::steady_clock::time_point start;
+    std::mutex mutex;
+    std::vector<const TraceSite*> sites;
+    std::deque<ThreadTrace> threads; // a deque does not move its elements when it grows
+    std::vector<TraceSample> samples;
+};
+
+TraceRegistry traceRegistry;
+
+TraceSite::TraceSite(const char* name, bool timed) : name(name), timed(timed) {
+    std::lock_guard<std::mutex> lock(traceRegistry.mutex);
+    id = traceRegistry.sites.size() < ThreadTrace::maxSites ? static_cast<int>(traceRegistry.sites.size()) : -1;
+    if (id != -1) {
+        traceRegistry.sites.push_back(this);
+    }
+}
+
+//the slots of the calling thread, registered on first use
+ThreadTrace& threadTrace() {
+    thread_local ThreadTrace* trace = [] {
+        std::lock_guard<std::mutex> lock(traceRegistry.mutex);
+        ThreadTrace& added = traceRegistry.threads.emplace_back();
+        added.id = static_cast<int>(traceRegistry.threads.size());
+        return &added;
+    }();
+    return *trace;
+}
+
+std::int64_t traceNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceRegistry.start).count();
+}
+
+class ScopedTimer {
+public:
+    explicit ScopedTimer(const TraceSite& site)
+        : site(site.id), begin(site.id != -1 && traceRegistry.enabled.load(std::memory_order_relaxed) ? traceNanos() : -1) {}
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    ~ScopedTimer() {
+        if (begin == -1) {
+            return;
+        }
+        std::int64_t duration = traceNanos() - begin;
+        ThreadTrace& trace = threadTrace();
+        ThreadTrace::add(trace.calls[site], 1);
+        ThreadTrace::add(trace.totals[site], duration);
+        if (duration >= traceEventMinNanos) {
+            std::lock_guard<std::mutex> lock(trace.eventsMutex);
+            if (trace.events.size() < ThreadTrace::maxEvents) {
+                trace.events.push_back({ site, begin, duration });
+            }
+        }
+    }
+
+private:
+    int site;
+    std::int64_t begin;
+};
+
+void countTrace(const TraceSite& site, std::uint64_t amount) {
+    if (site.id != -1 && traceRegistry.enabled.load(std::memory_order_relaxed)) {
+        ThreadTrace& trace = threadTrace();
+        ThreadTrace::add(trace.calls[site.id], 1);
+        ThreadTrace::add(trace.totals[site.id], amount);
+    }
+}
+
+void sampleTrace(std::string name, std::vector<std::pair<std::string, double>> values) {
+    if (traceRegistry.enabled.load(std::memory_order_relaxed)) {
+        std::int64_t nanos = traceNanos();
+        std::lock_guard<std::mutex> lock(traceRegistry.mutex);
+        traceRegistry.samples.push_back({ std::move(name), nanos, std::move(values) });
+    }
+}
+
+#define TRACE_JOIN2(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN2(a, b)
+#define TRACE_SCOPE(name) \
+    static const ::TraceSite TRACE_JOIN(traceSite, __LINE__)(name, true); \
+    ::ScopedTimer TRACE_JOIN(traceTimer, __LINE__)(TRACE_JOIN(traceSite, __LINE__))
+// amount is only evaluated while tracing is on, so a counter may be costly to compute
+#define TRACE_COUNT(name, amount) \
+    do { \
+        static const ::TraceSite traceSite(name, false); \
+        if (::traceRegistry.enabled.load(std::memory_order_relaxed)) { \
+            ::countTrace(traceSite, amount); \
+        } \
+    } while (false)
+// the values are { "name", value } pairs, only evaluated while tracing is on
+#define TRACE_SAMPLE(name, ...) \
+    do { \
+        if (::traceRegistry.enabled.load(std::memory_order_relaxed)) { \
+            ::sampleTrace(name, { __VA_ARGS__ }); \
+        } \
+    } while (false)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_COUNT(name, amount)
+#define TRACE_SAMPLE(name, ...)
+#endif
+
+#define CSV_IO_TRACE_SCOPE(name) TRACE_SCOPE(name)
+#define CSV_IO_TRACE_COUNT(name, amount) TRACE_COUNT(name, amount)
+#include "csv.h"
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+struct Video {
+    string video_id;
+    string country;
+    string trending_date;
+    string title;
+    string channel_title;
+    int category_id;
+    string publish_time;
+    string tags;
+    string temp_comments_disabled;
+    string temp_ratings_disabled;
+    string temp_video_error_or_removed;
+    int views;
+    int likes;
+    int dislikes;
+    int comment_count;
+    string thumbnail_link;
+    int comments_disabled;
+    int ratings_disabled;
+    int video_error_or_removed;
+    string description;
+};
+
+//weights of the engagement score (like * likes + dislike * dislikes + comment * comments) / views
+struct EngagementWeights {
+    double like = 1.0;
+    double dislike = 0.5;
+    double comment = 1.5;
+};
+
+//the scoring formulas --score accepts by name
+const pair<const char*, EngagementWeights> namedEngagementWeights[] = {
+    { "default", { 1.0, 0.5, 1.5 } },
+    { "likes", { 1.0, 0.0, 0.0 } },
+    { "comments", { 0.0, 0.0, 1.0 } },
+    { "approval", { 1.0, -1.0, 0.0 } },
+};
+
+EngagementWeights engagementWeights; // chosen with --score
+
+//scores[i] = engagement score of row i; a video without views (removed or private) scores 0
+void scoreEngagementScalar(const int* likes, const int* dislikes, const int* comments, const int* views, size_t count,
+    const EngagementWeights& weights, double* scores) {
+    for (size_t i = 0; i < count; ++i) {
+        double weighted = weights.like * likes[i] + weights.dislike * dislikes[i] + weights.comment * comments[i];
+        scores[i] = views[i] != 0 ? weighted / views[i] : 0.0;
+    }
+}
+
+// The vector kernels do the same multiplications, additions and division in the same order
+// as the scalar one, so every path gives bit-identical scores. Rows without views divide by
+// zero in their lane and are masked to 0 afterwards.
+#ifdef PROJECT17_SSE2
+void scoreEngagementSse2(const int* likes, const int* dislikes, const int* comments, const int* views, size_t count,
+    const EngagementWeights& weights, double* scores) {
+    const __m128d like = _mm_set1_pd(weights.like);
+    const __m128d dislike = _mm_set1_pd(weights.dislike);
+    const __m128d comment = _mm_set1_pd(weights.comment);
+    const __m128d zero = _mm_setzero_pd();
+    auto load = [](const int* p) { return _mm_cvtepi32_pd(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))); };
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d v = load(views + i);
+        __m128d weighted = _mm_add_pd(_mm_add_pd(_mm_mul_pd(like, load(likes + i)), _mm_mul_pd(dislike, load(dislikes + i))),
+            _mm_mul_pd(comment, load(comments + i)));
+        _mm_storeu_pd(scores + i, _mm_and_pd(_mm_div_pd(weighted, v), _mm_cmpneq_pd(v, zero)));
+    }
+    scoreEngagementScalar(likes + i, dislikes + i, comments + i, views + i, count - i, weights, scores + i);
+}
+#endif
+
+#ifdef PROJECT17_X86
+#if defined(__GNUC__) || defined(__clang__)
+#define PROJECT17_TARGET_AVX __attribute__((target("avx")))
+#else
+#define PROJECT17_TARGET_AVX // MSVC emits AVX intrinsics without a target switch
+#endif
+
+//int -> double conversion of 4 lanes only needs AVX, AVX2 adds nothing for this kernel
+PROJECT17_TARGET_AVX
+void scoreEngagementAvx(const int* likes, const int* dislikes, const int* comments, const int* views, size_t count,
+    const EngagementWeights& weights, double* scores) {
+    const __m256d like = _mm256_set1_pd(weights.like);
+    const __m256d dislike = _mm256_set1_pd(weights.dislike);
+    const __m256d comment = _mm256_set1_pd(weights.comment);
+    const __m256d zero = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d v = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(views + i)));
+        __m256d l = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(likes + i)));
+        __m256d d = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(dislikes + i)));
+        __m256d c = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(comments + i)));
+        __m256d weighted = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(like, l), _mm256_mul_pd(dislike, d)), _mm256_mul_pd(comment, c));
+        _mm256_storeu_pd(scores + i, _mm256_and_pd(_mm256_div_pd(weighted, v), _mm256_cmp_pd(v, zero, _CMP_NEQ_OQ)));
+    }
+    scoreEngagementScalar(likes + i, dislikes + i, comments + i, views + i, count - i, weights, scores + i);
+}
+
+//whether the CPU and the operating system support AVX
+bool cpuHasAvx() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    bool osSavesYmm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+    return osSavesYmm && (info[2] & (1 << 28)) != 0;
+#else
+    return __builtin_cpu_supports("avx");
+#endif
+}
+#endif
+
+//engagement scores of count rows given column by column, with the widest kernel the CPU runs
+void scoreEngagement(const int* likes, const int* dislikes, const int* comments, const int* views, size_t count,
+    const EngagementWeights& weights, double* scores) {
+#ifdef PROJECT17_X86
+    static const bool hasAvx = cpuHasAvx();
+    if (hasAvx) {
+        scoreEngagementAvx(likes, dislikes, comments, views, count, weights, scores);
+        return;
+    }
+#endif
+#ifdef PROJECT17_SSE2
+    scoreEngagementSse2(likes, dislikes, comments, views, count, weights, scores);
+#else
+    scoreEngagementScalar(likes, dislikes, comments, views, count, weights, scores);
+#endif
+}
+
+//validates and converts the user input for countries. Each comma-separated selection is a
+//country, ALL, or countries joined with + whose union is reported, e.g. "US, GB+CA, ALL"
+vector<string> validateAndConvertCountryInput(const string& input, const set<string>& valid_countries) {
+    string uppercaseInput = input;
+    transform(input.begin(), input.end(), uppercaseInput.begin(), ::toupper);
+    stringstream ss(uppercaseInput);
+    string token;
+    vector<string> result;
+
+    while (getline(ss, token, ',')) {
+        token.erase(remove(token.begin(), token.end(), ' '), token.end());
+        stringstream parts(token);
+        string part;
+        vector<string> union_countries;
+        while (getline(parts, part, '+')) {
+            if (valid_countries.count(part) == 0 && (part != "ALL" || token != "ALL")) {
+                return {}; // Invalid input, return an empty vector
+            }
+            // a country named twice would be summed twice
+            if (find(union_countries.begin(), union_countries.end(), part) == union_countries.end()) {
+                union_countries.push_back(part);
+            }
+        }
+        if (union_countries.empty() || token.back() == '+') {
+            return {};
+        }
+        token = union_countries[0];
+        for (size_t i = 1; i < union_countries.size(); ++i) {
+            token += "+" + union_countries[i];
+        }
+        result.push_back(token);
+    }
+
+    return result;
+}
+//calls f with a view of every tag in the video tags field, without copying the tags
+template <class F>
+void forEachTag(string_view tags, F f) {
+    size_t begin = 0;
+    while (begin < tags.size()) {
+        size_t end = tags.find('|', begin);
+        if (end == string_view::npos) {
+            end = tags.size();
+        }
+        f(tags.substr(begin, end - begin));
+        begin = end + 1;
+    }
+}
+//the case folded form of a code point of the scripts the trending countries use: Latin-1 and
+//Latin Extended-A, Greek and Cyrillic. Fullwidth ASCII is normalized to ASCII, except for the
+//vertical line, quotation mark and comma: as | they would split the tag, as " and , they would
+//need quoting in exported CSV. Every mapping is to a code point whose UTF-8 form is no longer
+//than the original's
+char32_t foldCodePoint(char32_t c) {
+    if (c < 0x80) {
+        return c >= 'A' && c <= 'Z' ? c + 0x20 : c;
+    }
+    if (c >= 0xC0 && c <= 0xDE && c != 0xD7) {
+        return c + 0x20;
+    }
+    if (c >= 0x100 && c <= 0x17F) {
+        bool evenUpper = c <= 0x12F || (c >= 0x132 && c <= 0x137) || (c >= 0x14A && c <= 0x177);
+        bool oddUpper = (c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E);
+        if ((evenUpper && c % 2 == 0) || (oddUpper && c % 2 == 1)) {
+            return c + 1;
+        }
+        return c == 0x178 ? 0xFF : c;
+    }
+    if (c >= 0x386 && c <= 0x3C2) {
+        if (c >= 0x391 && c <= 0x3A9 && c != 0x3A2) {
+            return c + 0x20;
+        }
+        switch (c) {
+        case 0x386: return 0x3AC;
+        case 0x388: case 0x389: case 0x38A: return c + 0x25;
+        case 0x38C: return 0x3CC;
+        case 0x38E: case 0x38F: return c + 0x3F;
+        case 0x3C2: return 0x3C3; // final sigma
+        default: return c;
+        }
+    }
+    if (c >= 0x400 && c <= 0x4BF) {
+        if (c <= 0x40F) {
+            return c + 0x50;
+        }
+        if (c <= 0x42F) {
+            return c + 0x20;
+        }
+        if (((c >= 0x460 && c <= 0x481) || c >= 0x48A) && c % 2 == 0) {
+            return c + 1;
+        }
+        return c;
+    }
+    if (c >= 0xFF01 && c <= 0xFF5E && c != 0xFF5C && c != 0xFF02 && c != 0xFF0C) {
+        return foldCodePoint(c - 0xFEE0);
+    }
+    return c;
+}
+
+//decodes the UTF-8 sequence at s[i], rejecting overlong forms, surrogates and code points past
+//U+10FFFF. Returns its length, 0 if it is not valid
+size_t decodeUtf8(string_view s, size_t i, char32_t& c) {
+    auto byte = [&](size_t k) { return i + k < s.size() ? static_cast<unsigned char>(s[i + k]) : 0u; };
+    auto continuation = [&](size_t k) { return (byte(k) & 0xC0) == 0x80; };
+    unsigned lead = byte(0);
+    if (lead < 0x80) {
+        c = lead;
+        return 1;
+    }
+    if (lead >= 0xC2 && lead <= 0xDF && continuation(1)) {
+        c = ((lead & 0x1F) << 6) | (byte(1) & 0x3F);
+        return 2;
+    }
+    if (lead >= 0xE0 && lead <= 0xEF && continuation(1) && continuation(2)) {
+        unsigned second = byte(1);
+        if ((lead == 0xE0 && second < 0xA0) || (lead == 0xED && second > 0x9F)) {
+            return 0;
+        }
+        c = ((lead & 0x0F) << 12) | ((second & 0x3F) << 6) | (byte(2) & 0x3F);
+        return 3;
+    }
+    if (lead >= 0xF0 && lead <= 0xF4 && continuation(1) && continuation(2) && continuation(3)) {
+        unsigned second = byte(1);
+        if ((lead == 0xF0 && second < 0x90) || (lead == 0xF4 && second > 0x8F)) {
+            return 0;
+        }
+        c = ((lead & 0x07) << 18) | ((second & 0x3F) << 12) | ((byte(2) & 0x3F) << 6) | (byte(3) & 0x3F);
+        return 4;
+    }
+    return 0;
+}
+
+char* encodeUtf8(char32_t c, char* out) {
+    if (c < 0x80) {
+        *out++ = static_cast<char>(c);
+    }
+    else if (c < 0x800) {
+        *out++ = static_cast<char>(0xC0 | (c >> 6));
+        *out++ = static_cast<char>(0x80 | (c & 0x3F));
+    }
+    else if (c < 0x10000) {
+        *out++ = static_cast<char>(0xE0 | (c >> 12));
+        *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        *out++ = static_cast<char>(0x80 | (c & 0x3F));
+    }
+    else {
+        *out++ = static_cast<char>(0xF0 | (c >> 18));
+        *out++ = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+        *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        *out++ = static_cast<char>(0x80 | (c & 0x3F));
+    }
+    return out;
+}
+
+//lower cases the ASCII letters of 8 ASCII bytes at once
+uint64_t lowerAscii8(uint64_t x) {
+    const uint64_t ones = 0x0101010101010101ull;
+    uint64_t atLeastA = x + (0x80 - 'A') * ones;
+    uint64_t pastZ = x + (0x80 - 'Z' - 1) * ones;
+    return x | (((atLeastA & ~pastZ) & (0x80 * ones)) >> 2);
+}
+
+//writes the tags field to out with every tag case folded (see foldCodePoint), leaving out the
+//tags that are not valid UTF-8. Runs of ASCII are checked and lower cased 16 or 8 bytes at a
+//time; only the bytes around non-ASCII characters are decoded one by one. Validation is not
+//vectorized beyond the ASCII check: a non-ASCII character has to be decoded to be folded anyway,
+//and the SSE2 baseline lacks the byte shuffle SIMD validators classify bytes with
+void foldTags(string_view tags, string& out) {
+    TRACE_SCOPE("foldTags");
+    out.resize(tags.size()); // no folding makes a tag longer
+    const char* in = tags.data();
+    char* begin = &out[0];
+    char* o = begin;
+    size_t i = 0;
+    size_t n = tags.size();
+    while (i < n) {
+#ifdef PROJECT17_SSE2
+        for (; i + 16 <= n; i += 16, o += 16) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            if (_mm_movemask_epi8(x) != 0) {
+                break;
+            }
+            __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(o), _mm_add_epi8(x, _mm_and_si128(upper, _mm_set1_epi8(0x20))));
+        }
+#endif
+        for (; i + 8 <= n; i += 8, o += 8) {
+            uint64_t x;
+            memcpy(&x, in + i, 8);
+            if (x & 0x8080808080808080ull) {
+                break;
+            }
+            x = lowerAscii8(x);
+            memcpy(o, &x, 8);
+        }
+        if (i == n) {
+            break;
+        }
+
+        char32_t c;
+        size_t length = decodeUtf8(tags, i, c);
+        if (length == 0) {
+            // drop the whole tag: back to the end of the previous one, on to the next
+            TRACE_COUNT("invalid UTF-8 tags", 1);
+            while (o != begin && o[-1] != '|') {
+                --o;
+            }
+            size_t next = tags.find('|', i);
+            i = next == string_view::npos ? n : next + 1;
+            continue;
+        }
+        o = encodeUtf8(foldCodePoint(c), o);
+        i += length;
+    }
+    out.resize(o - begin);
+}
+
+//calls f with every case folded, valid UTF-8 tag of the video tags field
+template <class F>
+void forEachFoldedTag(string_view tags, F f) {
+    thread_local string folded;
+    foldTags(tags, folded);
+    forEachTag(folded, [&](string_view tag) {
+        TRACE_COUNT("tags seen", 1);
+        f(tag);
+    });
+}
+
+//the case folded form of a tag the user typed
+string foldTag(string_view tag) {
+    string folded;
+    foldTags(tag, folded);
+    return folded;
+}
+
+//memory_resource that hands allocations on to upstream and counts them. An arena on top of it
+//tells how much memory the structure it backs holds
+class CountingResource : public pmr::memory_resource {
+public:
+    explicit CountingResource(pmr::memory_resource* upstream = pmr::new_delete_resource()) : upstream(upstream) {}
+
+    size_t bytes() const { return currentBytes.load(memory_order_relaxed); }
+    size_t peakBytes() const { return maxBytes.load(memory_order_relaxed); }
+    size_t allocations() const { return allocationCount.load(memory_order_relaxed); }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        void* p = upstream->allocate(bytes, alignment);
+        size_t now = currentBytes.fetch_add(bytes, memory_order_relaxed) + bytes;
+        size_t peak = maxBytes.load(memory_order_relaxed);
+        while (now > peak && !maxBytes.compare_exchange_weak(peak, now, memory_order_relaxed)) {
+        }
+        allocationCount.fetch_add(1, memory_order_relaxed);
+        return p;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        upstream->deallocate(p, bytes, alignment);
+        currentBytes.fetch_sub(bytes, memory_order_relaxed);
+    }
+
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+    pmr::memory_resource* upstream;
+    atomic<size_t> currentBytes{ 0 };
+    atomic<size_t> maxBytes{ 0 };
+    atomic<size_t> allocationCount{ 0 };
+};
+
+//tag -> value table of the aggregates. Its red-black nodes and tag strings are carved out of
+//an arena owned by the table: a new tag costs a pointer bump instead of two heap allocations,
+//neighbouring insertions share cache lines, and the table is freed in one go.
+class TagTable {
+public:
+    using Map = pmr::map<pmr::string, int, less<>>;
+
+    TagTable() : arena(&memory), values(new (arena.allocate(sizeof(Map), alignof(Map))) Map(&arena)) {}
+    TagTable(const TagTable&) = delete;
+    TagTable& operator=(const TagTable&) = delete;
+    // values is deliberately not destroyed: everything it owns lives in the arena, which
+    // hands its blocks back without visiting the nodes
+
+    int& operator[](string_view tag) {
+        auto it = values->lower_bound(tag);
+        if (it == values->end() || it->first != tag) {
+            it = values->emplace_hint(it, piecewise_construct, forward_as_tuple(tag), forward_as_tuple(0));
+        }
+        return it->second;
+    }
+
+    Map::const_iterator begin() const { return values->begin(); }
+    Map::const_iterator end() const { return values->end(); }
+    size_t size() const { return values->size(); }
+
+    //bytes the arena took from the heap, nodes and tag strings included
+    size_t memoryBytes() const { return memory.bytes(); }
+
+    //how many tags are too long to be stored inside their node, and the bytes they take
+    pair<size_t, size_t> longTagStrings() const {
+        pair<size_t, size_t> result{ 0, 0 };
+        for (const auto& entry : *values) {
+            if (entry.first.capacity() > pmr::string().capacity()) {
+                ++result.first;
+                result.second += entry.first.capacity() + 1;
+            }
+        }
+        return result;
+    }
+
+    //the entries sorted by tag
+    vector<pair<string, int>> entries() const {
+        vector<pair<string, int>> result;
+        result.reserve(values->size());
+        for (const auto& entry : *values) {
+            result.emplace_back(string(entry.first), entry.second);
+        }
+        return result;
+    }
+
+private:
+    CountingResource memory; // declared before the arena, which returns its blocks to it
+    pmr::monotonic_buffer_resource arena;
+    Map* values;
+};
+
+// Only the tables of each country are kept; rankings over several countries, or all of them,
+// are summed from these when they are asked for (see CountryTagArrays)
+map<string, TagTable> countryTagViews;
+map<string, TagTable> countryTagInteractions;
+
+//adds the video to the tag tables of its country; engagement is its score, computed by the caller
+void updateTagViewsAndInteractions(const Video& video, double engagement, map<string, TagTable>& countryTagViews,
+    map<string, TagTable>& countryTagInteractions) {
+    TRACE_SCOPE("aggregate update");
+    int tagViews = video.views;
+    // truncated once per video, so the sums are the same however the videos are grouped
+    // (pipeline threads, shards, spilled runs)
+    int weightedEngagement = static_cast<int>(engagement * tagViews);
+    TagTable& views = countryTagViews[video.country];
+    TagTable& interactions = countryTagInteractions[video.country];
+    forEachFoldedTag(video.tags, [&](string_view tag) {
+        views[tag] += tagViews;
+        interactions[tag] += weightedEngagement;
+        });
+}
+
+//KLL quantile sketch of ints. Level h holds items that stand for 2^h values each; a level
+//that outgrows its capacity is sorted and every other item moves up a level with twice the
+//weight. Capacities shrink by 2/3 per level below the top, so a sketch keeps at most about
+//3k items however many values it saw; with the default k it answered quantiles of up to a
+//million values within 1.5% of their rank. Two sketches merge by joining their levels and
+//compacting. The coin that picks the half moving up has a fixed seed, so results repeat
+class QuantileSketch {
+public:
+    //everything a sketch holds, to store it in a partial aggregate file and restore it
+    struct State {
+        uint16_t k;
+        uint64_t coin;
+        uint64_t n;
+        vector<vector<int>> levels;
+    };
+
+    explicit QuantileSketch(uint16_t k = 200) : k(k) {}
+    explicit QuantileSketch(State state) : k(state.k), coin(state.coin), n(state.n), levels(move(state.levels)) {}
+
+    State state() const { return { k, coin, n, levels }; }
+
+    void add(int value) {
+        if (levels.empty()) {
+            levels.emplace_back();
+        }
+        levels[0].push_back(value);
+        ++n;
+        if (levels[0].size() > capacity(0)) {
+            compress();
+        }
+    }
+
+    void merge(const QuantileSketch& other) {
+        if (levels.size() < other.levels.size()) {
+            levels.resize(other.levels.size());
+        }
+        for (size_t h = 0; h < other.levels.size(); ++h) {
+            levels[h].insert(levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+        }
+        n += other.n;
+        compress();
+    }
+
+    //the value at rank q * count, 0 <= q <= 1; 0 for an empty sketch
+    int quantile(double q) const {
+        vector<pair<int, uint64_t>> weighted;
+        uint64_t totalWeight = 0;
+        for (size_t h = 0; h < levels.size(); ++h) {
+            for (int value : levels[h]) {
+                weighted.emplace_back(value, uint64_t(1) << h);
+                totalWeight += uint64_t(1) << h;
+            }
+        }
+        if (weighted.empty()) {
+            return 0;
+        }
+        sort(weighted.begin(), weighted.end());
+        double rank = q * totalWeight;
+        uint64_t below = 0;
+        for (const auto& item : weighted) {
+            below += item.second;
+            if (below >= rank) {
+                return item.first;
+            }
+        }
+        return weighted.back().first;
+    }
+
+    uint64_t count() const { return n; }
+
+    size_t itemCount() const {
+        size_t items = 0;
+        for (const vector<int>& level : levels) {
+            items += level.size();
+        }
+        return items;
+    }
+
+    //heap bytes of the levels
+    size_t memoryBytes() const {
+        size_t bytes = levels.capacity() * sizeof(vector<int>);
+        for (const vector<int>& level : levels) {
+            bytes += level.capacity() * sizeof(int);
+        }
+        return bytes;
+    }
+
+private:
+    size_t capacity(size_t level) const {
+        double c = k;
+        for (size_t h = level + 1; h < levels.size(); ++h) {
+            c *= 2.0 / 3.0;
+        }
+        return max<size_t>(2, static_cast<size_t>(c));
+    }
+
+    void compress() {
+        for (size_t h = 0; h < levels.size(); ++h) {
+            if (levels[h].size() <= capacity(h)) {
+                continue;
+            }
+            if (h + 1 == levels.size()) {
+                levels.emplace_back(); // the capacities below the new top shrink, checked on the next rounds
+            }
+            vector<int>& level = levels[h];
+            sort(level.begin(), level.end());
+            int kept = 0;
+            if (level.size() % 2 != 0) {
+                kept = level.back(); // an odd item stays, so the weight is kept exactly
+            }
+            size_t pairs = level.size() / 2;
+            for (size_t i = 0; i < pairs; ++i) {
+                levels[h + 1].push_back(level[2 * i + (coin & 1)]);
+            }
+            coin ^= coin << 13; // xorshift
+            coin ^= coin >> 7;
+            coin ^= coin << 17;
+            bool odd = level.size() % 2 != 0;
+            level.clear();
+            if (odd) {
+                level.push_back(kept);
+            }
+        }
+    }
+
+    uint16_t k;
+    uint64_t coin = 0x9E3779B97F4A7C15ull; // picks the half that moves up; seeded the same for every sketch
+    uint64_t n = 0;
+    vector<vector<int>> levels;
+};
+
+//count, mean and variance of the views of the videos with a tag, kept with Welford's update
+//and merged with Chan's formula, and a sketch of their quantiles
+struct TagStats {
+    uint64_t count = 0;
+    double mean = 0;
+    double m2 = 0; // sum of squared differences from the mean
+    QuantileSketch views;
+
+    void add(int value) {
+        ++count;
+        double delta = value - mean;
+        mean += delta / count;
+        m2 += delta * (value - mean);
+        views.add(value);
+    }
+
+    void merge(const TagStats& other) {
+        if (other.count == 0) {
+            return;
+        }
+        uint64_t total = count + other.count;
+        double delta = other.mean - mean;
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * (static_cast<double>(count) * other.count / total);
+        count = total;
+        views.merge(other.views);
+    }
+
+    double standardDeviation() const { return count > 1 ? sqrt(m2 / (count - 1)) : 0; }
+};
+
+using TagStatsTable = map<string, TagStats, less<>>;
+
+//distribution of the views per tag of every country; like the tag tables, the statistics
+//over several countries are merged when they are asked for
+struct TagStatsTables {
+    map<string, TagStatsTable> countries;
+
+    void merge(const TagStatsTables& other) {
+        for (const auto& country : other.countries) {
+            TagStatsTable& table = countries[country.first];
+            for (const auto& entry : country.second) {
+                table[entry.first].merge(entry.second);
+            }
+        }
+    }
+
+    //the statistics of the tags over the countries
+    TagStatsTable merged(const vector<string>& names) const {
+        TagStatsTable result;
+        for (const string& name : names) {
+            auto country = countries.find(name);
+            if (country == countries.end()) {
+                continue;
+            }
+            for (const auto& entry : country->second) {
+                result[entry.first].merge(entry.second);
+            }
+        }
+        return result;
+    }
+};
+
+//adds the views of the video to the statistics of each of its tags
+void updateTagStats(const Video& video, TagStatsTables& stats) {
+    TRACE_SCOPE("tag stats update");
+    TagStatsTable& country = stats.countries[video.country];
+    forEachFoldedTag(video.tags, [&](string_view tag) {
+        auto it = country.lower_bound(tag);
+        if (it == country.end() || it->first != tag) {
+            it = country.emplace_hint(it, string(tag), TagStats());
+        }
+        it->second.add(video.views);
+        });
+}
+
+//nodes and their keys are allocated from an arena (see insertNode), so a tree is freed by
+//releasing the arena instead of walking it. The trees are not rebalanced, so tags arriving in
+//sorted order make a chain: every walk below loops with an explicit stack instead of recursing
+struct TreeNode {
+    string_view key;
+    int value;
+    TreeNode* left;
+    TreeNode* right;
+
+    TreeNode(string_view key, int value) : key(key), value(value), left(nullptr), right(nullptr) {}
+    size_t size() const {
+        size_t count = 0;
+        vector<const TreeNode*> pending{ this };
+        while (!pending.empty()) {
+            const TreeNode* node = pending.back();
+            pending.pop_back();
+            ++count;
+            if (node->left) {
+                pending.push_back(node->left);
+            }
+            if (node->right) {
+                pending.push_back(node->right);
+            }
+        }
+        return count;
+    }
+};
+
+TreeNode* newTreeNode(string_view key, int value, pmr::memory_resource& arena) {
+    char* keyCopy = static_cast<char*>(arena.allocate(key.size(), 1));
+    copy(key.begin(), key.end(), keyCopy);
+    return new (arena.allocate(sizeof(TreeNode), alignof(TreeNode))) TreeNode(string_view(keyCopy, key.size()), value);
+}
+
+TreeNode* insertNode(TreeNode* root, string_view key, int value, pmr::memory_resource& arena) {
+    TreeNode** link = &root;
+    while (*link != nullptr) {
+        TreeNode* node = *link;
+        if (key < node->key) {
+            link = &node->left;
+        }
+        else if (key > node->key) {
+            link = &node->right;
+        }
+        else {
+            node->value += value;
+            return root;
+        }
+    }
+    *link = newTreeNode(key, value, arena);
+    return root;
+}
+
+TreeNode* searchNode(TreeNode* root, string_view key) {
+    while (root != nullptr && root->key != key) {
+        root = key < root->key ? root->left : root->right;
+    }
+    return root;
+}
+
+//calls f(node) for the nodes in key order
+template <class F>
+void forEachInOrder(TreeNode* root, F f) {
+    vector<TreeNode*> pending;
+    while (root != nullptr || !pending.empty()) {
+        while (root != nullptr) {
+            pending.push_back(root);
+            root = root->left;
+        }
+        TreeNode* node = pending.back();
+        pending.pop_back();
+        f(node);
+        root = node->right;
+    }
+}
+
+//builds a balanced tree of entries[begin, end), sorted by key without repeats, median first
+TreeNode* buildBalancedTree(const vector<pair<string_view, int>>& entries, size_t begin, size_t end, pmr::memory_resource& arena) {
+    if (begin == end) {
+        return nullptr;
+    }
+    size_t middle = begin + (end - begin) / 2;
+    TreeNode* node = newTreeNode(entries[middle].first, entries[middle].second, arena);
+    node->left = buildBalancedTree(entries, begin, middle, arena);
+    node->right = buildBalancedTree(entries, middle + 1, end, arena);
+    return node;
+}
+
+//adds the entries to the tree and rebuilds it balanced. Inserting a sorted run one key at a time,
+//as the tag tables hand out their tags, would hang a chain as long as the run off the tree
+TreeNode* mergeIntoTree(TreeNode* root, vector<pair<string_view, int>> entries, pmr::memory_resource& arena) {
+    forEachInOrder(root, [&](TreeNode* node) { entries.emplace_back(node->key, node->value); });
+    stable_sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    size_t kept = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (kept != 0 && entries[kept - 1].first == entries[i].first) {
+            entries[kept - 1].second += entries[i].second;
+        }
+        else {
+            entries[kept++] = entries[i];
+        }
+    }
+    entries.resize(kept);
+    // the old nodes stay in the arena until it is released
+    return buildBalancedTree(entries, 0, entries.size(), arena);
+}
+
+//the BST report keeps one pair of trees for the videos of all countries; engagement is the score
+//of the video, computed by the caller
+void updateTagViewsAndInteractionsBST(const Video& video, double engagement, TreeNode*& countryTagViewsRoot,
+    TreeNode*& countryTagInteractionsRoot, pmr::memory_resource& treeArena) {
+    TRACE_SCOPE("aggregate update");
+    int tagViews = video.views;
+    // truncated once per video, so the sums are the same however the videos are grouped
+    // (pipeline threads, shards, spilled runs)
+    int weightedEngagement = static_cast<int>(engagement * tagViews);
+    forEachFoldedTag(video.tags, [&](string_view tag) {
+        TreeNode* countryNode = searchNode(countryTagViewsRoot, tag);
+        if (countryNode) {
+            countryNode->value += tagViews;
+        }
+        else {
+            countryTagViewsRoot = insertNode(countryTagViewsRoot, tag, tagViews, treeArena);
+        }
+
+        TreeNode* countryInteractionNode = searchNode(countryTagInteractionsRoot, tag);
+        if (countryInteractionNode) {
+            countryInteractionNode->value += weightedEngagement;
+        }
+        else {
+            countryTagInteractionsRoot = insertNode(countryTagInteractionsRoot, tag, weightedEngagement, treeArena);
+        }
+        });
+}
+
+void inOrderTraversal(TreeNode* root, vector<pair<string, int>>& result) {
+    forEachInOrder(root, [&](TreeNode* node) { result.push_back(make_pair(string(node->key), node->value)); });
+}
+
+
+vector<pair<string, int>> topNElements(const TagTable& m, size_t n) {
+    TRACE_SCOPE("topN");
+    vector<pair<string, int>> topElements;
+    for (const auto& entry : m) {
+        topElements.emplace_back(string(entry.first), entry.second);
+    }
+
+    // ties by tag, so the order does not depend on how the tags were stored
+    sort(topElements.begin(), topElements.end(), [](const auto& a, const auto& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+
+    if (topElements.size() > n) {
+        topElements.resize(n);
+    }
+
+    return topElements;
+}
+
+vector<pair<string, int>> topNElementsFromBST(TreeNode* root, size_t n) {
+    TRACE_SCOPE("topN");
+    vector<pair<string, int>> elements;
+    inOrderTraversal(root, elements);
+
+    sort(elements.begin(), elements.end(), [](const auto& a, const auto& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+
+    if (elements.size() > n) {
+        elements.resize(n);
+    }
+
+    return elements;
+}
+
+vector<string> split(const string& str, char delimiter) {
+    vector<string> result;
+    stringstream ss(str);
+    string item;
+
+    while (getline(ss, item, delimiter)) {
+        result.push_back(item);
+    }
+
+    return result;
+}
+
+void trim(string& str) {
+    size_t first = str.find_first_not_of(' ');
+    if (first == string::npos) {
+        str = "";
+        return;
+    }
+    size_t last = str.find_last_not_of(' ');
+    str = str.substr(first, last - first + 1);
+}
+
+//output buffer for reports and exports. Numbers are formatted with to_chars straight into the
+//buffer, and a full buffer goes to the file in one fwrite, which a buffer this size turns into
+//one write call. Text written to the same FILE through cout before stays in order, as cout is
+//synchronized with stdio
+class ReportWriter {
+public:
+    explicit ReportWriter(FILE* file, size_t capacity = 1 << 20) : file(file), buffer(capacity) {}
+    ReportWriter(const ReportWriter&) = delete;
+    ReportWriter& operator=(const ReportWriter&) = delete;
+    ~ReportWriter() { flush(); }
+
+    ReportWriter& operator<<(string_view text) {
+        reserve(text.size());
+        memcpy(buffer.data() + used, text.data(), text.size());
+        used += text.size();
+        return *this;
+    }
+
+    ReportWriter& operator<<(char c) {
+        reserve(1);
+        buffer[used++] = c;
+        return *this;
+    }
+
+    template <class T, class = enable_if_t<is_integral_v<T> && !is_same_v<T, char> && !is_same_v<T, bool>>>
+    ReportWriter& operator<<(T value) {
+        reserve(24);
+        used = to_chars(buffer.data() + used, buffer.data() + buffer.size(), value).ptr - buffer.data();
+        return *this;
+    }
+
+    //the value with a fixed number of decimals
+    ReportWriter& fixed(double value, int decimals) {
+        char text[64];
+        int length = snprintf(text, sizeof(text), "%.*f", decimals, value);
+        return *this << string_view(text, min<size_t>(max(length, 0), sizeof(text) - 1));
+    }
+
+    //the text as a CSV field, quoted if it contains a separator, a quote or a line break
+    ReportWriter& csvField(string_view text) {
+        if (text.find_first_of(",\"\r\n") == string_view::npos) {
+            return *this << text;
+        }
+        *this << '"';
+        for (char c : text) {
+            if (c == '"') {
+                *this << '"';
+            }
+            *this << c;
+        }
+        return *this << '"';
+    }
+
+    //the text as a JSON string; tags are valid UTF-8, so only quotes, backslashes and control
+    //characters need escaping
+    ReportWriter& jsonString(string_view text) {
+        *this << '"';
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                *this << '\\' << c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20) {
+                const char* hex = "0123456789abcdef";
+                *this << "\\u00" << hex[c >> 4] << hex[c & 0xF];
+            }
+            else {
+                *this << c;
+            }
+        }
+        return *this << '"';
+    }
+
+    void flush() {
+        if (used != 0) {
+            if (fwrite(buffer.data(), 1, used, file) != used) {
+                writeFailed = true;
+            }
+            used = 0;
+        }
+    }
+
+    bool failed() const { return writeFailed; }
+
+private:
+    void reserve(size_t length) {
+        if (used + length > buffer.size()) {
+            flush();
+            if (length > buffer.size()) {
+                buffer.resize(length);
+            }
+        }
+    }
+
+    FILE* file;
+    vector<char> buffer;
+    size_t used = 0;
+    bool writeFailed = false;
+};
+
+//writes the first n entries of a ranking under a title, or the last n from the bottom up
+template <class Ranking>
+void printRanking(ReportWriter& out, string_view title, const Ranking& ranking, size_t n, bool fromBottom) {
+    n = min(n, ranking.size());
+    out << '\n' << title << '\n';
+    for (size_t i = 0; i < n; ++i) {
+        const auto& element = fromBottom ? ranking[ranking.size() - 1 - i] : ranking[i];
+        out << element.first << ": " << element.second << '\n';
+    }
+}
+
+enum class ExportFormat { csv, jsonl };
+
+//sorts tag -> value pairs by value, highest first and ties by tag
+template <class Value>
+void sortRanking(vector<pair<string_view, Value>>& ranking) {
+    sort(ranking.begin(), ranking.end(), [](const auto& a, const auto& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+}
+
+//ranks the tags by value without copying them
+vector<pair<string_view, int>> rankTags(const TagTable& table) {
+    vector<pair<string_view, int>> ranking;
+    ranking.reserve(table.size());
+    for (const auto& entry : table) {
+        ranking.emplace_back(entry.first, entry.second);
+    }
+    sortRanking(ranking);
+    return ranking;
+}
+
+vector<pair<string_view, int>> rankTags(TreeNode* root) {
+    vector<pair<string_view, int>> ranking;
+    vector<TreeNode*> stack;
+    for (TreeNode* node = root; node != nullptr || !stack.empty();) {
+        if (node != nullptr) {
+            stack.push_back(node);
+            node = node->left;
+        }
+        else {
+            node = stack.back();
+            stack.pop_back();
+            ranking.emplace_back(node->key, node->value);
+            node = node->right;
+        }
+    }
+    sortRanking(ranking);
+    return ranking;
+}
+
+//the tags of the tables in byte order, each once
+vector<string_view> sortedTagUnion(const map<string, TagTable>& tables) {
+    vector<string_view> tags;
+    for (const auto& table : tables) {
+        for (const auto& entry : table.second) {
+            tags.emplace_back(entry.first);
+        }
+    }
+    sort(tags.begin(), tags.end());
+    tags.erase(unique(tags.begin(), tags.end()), tags.end());
+    return tags;
+}
+
+//out[i] += in[i] for n ints added to 64-bit sums
+void addToSums(const int* in, long long* out, size_t n) {
+    size_t i = 0;
+#ifdef PROJECT17_SSE2
+    for (; i + 4 <= n; i += 4) {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i signs = _mm_srai_epi32(values, 31); // sign extension, SSE2 has no widening conversion
+        __m128i* sums = reinterpret_cast<__m128i*>(out + i);
+        _mm_storeu_si128(sums, _mm_add_epi64(_mm_loadu_si128(sums), _mm_unpacklo_epi32(values, signs)));
+        _mm_storeu_si128(sums + 1, _mm_add_epi64(_mm_loadu_si128(sums + 1), _mm_unpackhi_epi32(values, signs)));
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] += in[i];
+    }
+}
+
+//out[i] |= in[i] for n bytes
+void orBytes(const uint8_t* in, uint8_t* out, size_t n) {
+    size_t i = 0;
+#ifdef PROJECT17_SSE2
+    for (; i + 16 <= n; i += 16) {
+        __m128i* bytes = reinterpret_cast<__m128i*>(out + i);
+        _mm_storeu_si128(bytes, _mm_or_si128(_mm_loadu_si128(bytes), _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))));
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] |= in[i];
+    }
+}
+
+//the tag tables of every country laid out as dense arrays over one shared tag id space, ids
+//in tag order. The views and interaction of any set of countries are the elementwise sums of
+//their arrays, added four tags at a time, so ingest only keeps the tables of each country
+//instead of also updating all-country tables for every tag of every row
+class CountryTagArrays {
+public:
+    CountryTagArrays(const map<string, TagTable>& views, const map<string, TagTable>& interaction) {
+        TRACE_SCOPE("country tag arrays build");
+        for (string_view tag : sortedTagUnion(views)) {
+            tags.emplace_back(tag);
+        }
+        for (const auto& country : views) {
+            const TagTable& countryInteraction = interaction.at(country.first);
+            if (countryInteraction.size() != country.second.size()) {
+                throw logic_error("the views and interaction tables of " + country.first + " hold different tags");
+            }
+            Arrays& arrays = countries[country.first];
+            arrays.views.assign(tags.size(), 0);
+            arrays.interaction.assign(tags.size(), 0);
+            arrays.present.assign(tags.size(), 0);
+            size_t id = 0;
+            auto i = countryInteraction.begin();
+            for (const auto& entry : country.second) {
+                while (string_view(tags[id]) != string_view(entry.first)) { // the table and the ids are both in tag order
+                    ++id;
+                }
+                arrays.views[id] = entry.second;
+                arrays.interaction[id] = (i++)->second;
+                arrays.present[id] = 1;
+            }
+        }
+    }
+
+    size_t tagCount() const { return tags.size(); }
+
+    vector<string> countryNames() const {
+        vector<string> names;
+        for (const auto& country : countries) {
+            names.push_back(country.first);
+        }
+        return names;
+    }
+
+    //calls f(tag, views, interaction) in tag order for every tag any of the countries has, with
+    //its sums over them. Countries without tags are left out
+    template <class F>
+    void forEachTag(const vector<string>& names, F f) const {
+        TRACE_SCOPE("country tag arrays sum");
+        vector<long long> views(tags.size());
+        vector<long long> interaction(tags.size());
+        vector<uint8_t> present(tags.size());
+        for (const string& name : names) {
+            auto country = countries.find(name);
+            if (country == countries.end()) {
+                continue;
+            }
+            const Arrays& arrays = country->second;
+            addToSums(arrays.views.data(), views.data(), tags.size());
+            addToSums(arrays.interaction.data(), interaction.data(), tags.size());
+            orBytes(arrays.present.data(), present.data(), tags.size());
+        }
+        for (size_t id = 0; id < tags.size(); ++id) {
+            if (present[id]) {
+                f(string_view(tags[id]), views[id], interaction[id]);
+            }
+        }
+    }
+
+    //the views and interaction rankings of the tags of the countries, summed over them
+    void rank(const vector<string>& names, vector<pair<string_view, long long>>& views,
+        vector<pair<string_view, long long>>& interaction) const {
+        views.clear();
+        interaction.clear();
+        forEachTag(names, [&](string_view tag, long long tagViews, long long tagInteraction) {
+            views.emplace_back(tag, tagViews);
+            interaction.emplace_back(tag, tagInteraction);
+            });
+        sortRanking(views);
+        sortRanking(interaction);
+    }
+
+    //the tag, views and interaction pairs of the countries in tag order, the sums saturated to int
+    void entries(const vector<string>& names, vector<pair<string, int>>& views, vector<pair<string, int>>& interaction) const {
+        auto saturated = [](long long value) {
+            return static_cast<int>(max<long long>(INT_MIN, min<long long>(INT_MAX, value)));
+        };
+        forEachTag(names, [&](string_view tag, long long tagViews, long long tagInteraction) {
+            views.emplace_back(string(tag), saturated(tagViews));
+            interaction.emplace_back(string(tag), saturated(tagInteraction));
+            });
+    }
+
+    size_t memoryBytes() const {
+        size_t bytes = tags.capacity() * sizeof(string);
+        for (const string& tag : tags) {
+            bytes += tag.capacity() > string().capacity() ? tag.capacity() + 1 : 0;
+        }
+        for (const auto& country : countries) {
+            bytes += country.second.views.capacity() * sizeof(int) + country.second.interaction.capacity() * sizeof(int)
+                + country.second.present.capacity();
+        }
+        return bytes;
+    }
+
+private:
+    struct Arrays {
+        vector<int> views;
+        vector<int> interaction;
+        vector<uint8_t> present; // 1 for the tags the country has
+    };
+
+    vector<string> tags;
+    map<string, Arrays> countries;
+};
+
+//writes a full ranking to directory/name.csv or name.jsonl, one row per tag with its rank, the
+//tag and the value under valueName. Throws runtime_error if the file can not be written
+template <class Value>
+void exportRanking(const fs::path& directory, const string& name, const vector<pair<string_view, Value>>& ranking,
+    ExportFormat format, const char* valueName) {
+    fs::path path = directory / (name + (format == ExportFormat::csv ? ".csv" : ".jsonl"));
+    unique_ptr<FILE, int (*)(FILE*)> file(fopen(path.string().c_str(), "wb"), fclose);
+    if (!file) {
+        throw runtime_error("can not create " + path.string() + ": " + strerror(errno));
+    }
+    setvbuf(file.get(), nullptr, _IONBF, 0); // the writer's buffer is the only one
+    ReportWriter out(file.get());
+    if (format == ExportFormat::csv) {
+        out << "rank,tag," << valueName << '\n';
+    }
+    size_t rank = 0;
+    for (const auto& entry : ranking) {
+        ++rank;
+        if (format == ExportFormat::csv) {
+            out << rank << ',';
+            out.csvField(entry.first) << ',' << entry.second << '\n';
+        }
+        else {
+            out << "{\"rank\":" << rank << ",\"tag\":";
+            out.jsonString(entry.first) << ",\"" << valueName << "\":" << entry.second << "}\n";
+        }
+    }
+    out.flush();
+    if (out.failed()) {
+        throw runtime_error("can not write " + path.string() + ": " + strerror(errno));
+    }
+}
+
+//the statistic of a tag --tag-stats ranks by: mean, p50, p90 or p99 views
+double tagStatistic(const TagStats& stats, const string& metric) {
+    if (metric == "mean") {
+        return stats.mean;
+    }
+    return stats.views.quantile(metric == "p50" ? 0.5 : metric == "p90" ? 0.9 : 0.99);
+}
+
+//writes the n tags with at least minVideos videos that rank first by the statistic, with
+//their whole distribution summary
+void printTagStatsRanking(ReportWriter& out, const TagStatsTable& table, const string& metric, size_t minVideos, size_t n) {
+    vector<pair<double, const TagStatsTable::value_type*>> ranking;
+    for (const auto& entry : table) {
+        if (entry.second.count >= minVideos) {
+            ranking.emplace_back(tagStatistic(entry.second, metric), &entry);
+        }
+    }
+    sort(ranking.begin(), ranking.end(), [](const auto& a, const auto& b) {
+        return a.first != b.first ? a.first > b.first : a.second->first < b.second->first;
+        });
+    ranking.resize(min(n, ranking.size()));
+
+    const char* metricName = metric == "mean" ? "mean views" : metric == "p50" ? "median views"
+        : metric == "p90" ? "90th percentile of views" : "99th percentile of views";
+    out << "\nTop " << n << " keywords/tags by " << metricName << " (at least " << minVideos << " videos):\n";
+    for (const auto& entry : ranking) {
+        const TagStats& stats = entry.second->second;
+        out << entry.second->first << ": ";
+        out.fixed(entry.first, 0) << " (" << stats.count << " videos, mean ";
+        out.fixed(stats.mean, 0) << ", sd ";
+        out.fixed(stats.standardDeviation(), 0) << ", p50 " << stats.views.quantile(0.5) << ", p90 " << stats.views.quantile(0.9)
+            << ", p99 " << stats.views.quantile(0.99) << ")\n";
+    }
+}
+
+//writes the distribution summary of every tag to directory/name.csv or name.jsonl.
+//Throws runtime_error if the file can not be written
+void exportTagStats(const fs::path& directory, const string& name, const TagStatsTable& table, ExportFormat format) {
+    fs::path path = directory / (name + (format == ExportFormat::csv ? ".csv" : ".jsonl"));
+    unique_ptr<FILE, int (*)(FILE*)> file(fopen(path.string().c_str(), "wb"), fclose);
+    if (!file) {
+        throw runtime_error("can not create " + path.string() + ": " + strerror(errno));
+    }
+    setvbuf(file.get(), nullptr, _IONBF, 0); // the writer's buffer is the only one
+    ReportWriter out(file.get());
+    if (format == ExportFormat::csv) {
+        out << "tag,videos,mean,sd,p50,p90,p99\n";
+    }
+    for (const auto& entry : table) {
+        const TagStats& stats = entry.second;
+        if (format == ExportFormat::csv) {
+            out.csvField(entry.first) << ',' << stats.count << ',';
+            out.fixed(stats.mean, 2) << ',';
+            out.fixed(stats.standardDeviation(), 2) << ',';
+        }
+        else {
+            out << "{\"tag\":";
+            out.jsonString(entry.first) << ",\"videos\":" << stats.count << ",\"mean\":";
+            out.fixed(stats.mean, 2) << ",\"sd\":";
+            out.fixed(stats.standardDeviation(), 2) << ",\"p50\":";
+        }
+        out << stats.views.quantile(0.5) << (format == ExportFormat::csv ? "," : ",\"p90\":") << stats.views.quantile(0.9)
+            << (format == ExportFormat::csv ? "," : ",\"p99\":") << stats.views.quantile(0.99)
+            << (format == ExportFormat::csv ? "\n" : "}\n");
+    }
+    out.flush();
+    if (out.failed()) {
+        throw runtime_error("can not write " + path.string() + ": " + strerror(errno));
+    }
+}
+
+//interns tag strings so every distinct tag is stored once and referred to by a dense id
+class TagDictionary {
+public:
+    TagDictionary() = default;
+    // a copy would keep the views in ids pointing into the other dictionary's names; a move
+    // takes the deque nodes along, so the views stay valid
+    TagDictionary(const TagDictionary&) = delete;
+    TagDictionary& operator=(const TagDictionary&) = delete;
+    TagDictionary(TagDictionary&&) = default;
+    TagDictionary& operator=(TagDictionary&&) = default;
+
+    int intern(string_view tag) {
+        TRACE_COUNT("hash probes", 1);
+        auto it = ids.find(tag);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        int id = static_cast<int>(names.size());
+        names.emplace_back(tag);
+        ids.emplace(string_view(names.back()), id);
+        return id;
+    }
+
+    int find(string_view tag) const {
+        TRACE_COUNT("hash probes", 1);
+        auto it = ids.find(tag);
+        return it == ids.end() ? -1 : it->second;
+    }
+
+    const string& name(int id) const { return names[id]; }
+    size_t size() const { return names.size(); }
+
+private:
+    deque<string> names; // deque keeps the strings in place, so the views in ids stay valid
+    unordered_map<string_view, int> ids;
+};
+
+//sparse tag co-occurrence matrix of one country, restricted to its top-M tags by views.
+//Row i lists the tags that appear together with tag i, weighted by the views of the
+//videos they share, strongest association first.
+struct TagCooccurrence {
+    TagDictionary tags; // tag id == rank of the tag by views
+    vector<size_t> rowBegin; // tags.size() + 1 offsets into neighbours
+    vector<pair<int, long long>> neighbours;
+
+    vector<pair<string, long long>> mostAssociated(string_view tag, size_t n) const {
+        vector<pair<string, long long>> result;
+        int id = tags.find(tag);
+        if (id < 0) {
+            return result;
+        }
+        size_t end = min(rowBegin[id + 1], rowBegin[id] + n);
+        for (size_t i = rowBegin[id]; i < end; ++i) {
+            result.emplace_back(tags.name(neighbours[i].first), neighbours[i].second);
+        }
+        return result;
+    }
+};
+
+//runs f(thread index, begin, end) over [0, count) split into one contiguous range per thread
+template <class F>
+void parallelFor(size_t count, unsigned threadCount, F f) {
+    threadCount = static_cast<unsigned>(max<size_t>(1, min<size_t>(threadCount, count)));
+    vector<thread> workers;
+    size_t chunk = (count + threadCount - 1) / threadCount;
+    for (unsigned t = 0; t < threadCount; ++t) {
+        size_t begin = t * chunk;
+        size_t end = min(count, begin + chunk);
+        workers.emplace_back([=, &f] { f(t, begin, end); });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+}
+
+TagCooccurrence buildTagCooccurrence(const vector<Video>& videos, const vector<size_t>& rows, size_t topM, unsigned threadCount) {
+    threadCount = max(1u, threadCount);
+
+    // The tags of every row case folded once, the views of pass 1 point into them.
+    vector<string> folded(rows.size());
+    parallelFor(rows.size(), threadCount, [&](unsigned, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            foldTags(videos[rows[i]].tags, folded[i]);
+        }
+    });
+
+    // Pass 1: views per tag, to pick the top-M tags that get a row in the matrix.
+    vector<unordered_map<string_view, long long>> localViews(threadCount);
+    parallelFor(rows.size(), threadCount, [&](unsigned t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const Video& video = videos[rows[i]];
+            forEachTag(folded[i], [&](string_view tag) {
+                localViews[t][tag] += video.views;
+            });
+        }
+    });
+    for (unsigned t = 1; t < threadCount; ++t) {
+        for (const auto& entry : localViews[t]) {
+            localViews[0][entry.first] += entry.second;
+        }
+    }
+    vector<pair<string_view, long long>> ranked(localViews[0].begin(), localViews[0].end());
+    sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+    if (ranked.size() > topM) {
+        ranked.resize(topM);
+    }
+
+    TagCooccurrence result;
+    for (const auto& entry : ranked) {
+        result.tags.intern(entry.first);
+    }
+
+    // Pass 2: every thread accumulates the pairs of its own rows into a sparse map keyed
+    // by (smaller id, larger id); the maps are merged once at the end.
+    vector<unordered_map<uint64_t, long long>> localPairs(threadCount);
+    parallelFor(rows.size(), threadCount, [&](unsigned t, size_t begin, size_t end) {
+        vector<int> ids;
+        for (size_t i = begin; i < end; ++i) {
+            const Video& video = videos[rows[i]];
+            ids.clear();
+            forEachTag(folded[i], [&](string_view tag) {
+                int id = result.tags.find(tag);
+                if (id >= 0) {
+                    ids.push_back(id);
+                }
+            });
+            sort(ids.begin(), ids.end());
+            ids.erase(unique(ids.begin(), ids.end()), ids.end());
+            for (size_t a = 0; a < ids.size(); ++a) {
+                for (size_t b = a + 1; b < ids.size(); ++b) {
+                    localPairs[t][(uint64_t(ids[a]) << 32) | uint64_t(ids[b])] += video.views;
+                }
+            }
+        }
+    });
+    for (unsigned t = 1; t < threadCount; ++t) {
+        for (const auto& entry : localPairs[t]) {
+            localPairs[0][entry.first] += entry.second;
+        }
+        localPairs[t].clear();
+    }
+
+    // Lay the symmetric matrix out as compressed rows.
+    size_t tagCount = result.tags.size();
+    vector<size_t> degree(tagCount + 1, 0);
+    for (const auto& entry : localPairs[0]) {
+        ++degree[entry.first >> 32];
+        ++degree[entry.first & 0xffffffffu];
+    }
+    result.rowBegin.assign(tagCount + 1, 0);
+    for (size_t i = 0; i < tagCount; ++i) {
+        result.rowBegin[i + 1] = result.rowBegin[i] + degree[i];
+    }
+    result.neighbours.resize(result.rowBegin[tagCount]);
+    vector<size_t> fill(result.rowBegin.begin(), result.rowBegin.end() - 1);
+    for (const auto& entry : localPairs[0]) {
+        int a = static_cast<int>(entry.first >> 32);
+        int b = static_cast<int>(entry.first & 0xffffffffu);
+        result.neighbours[fill[a]++] = make_pair(b, entry.second);
+        result.neighbours[fill[b]++] = make_pair(a, entry.second);
+    }
+    parallelFor(tagCount, threadCount, [&](unsigned, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            sort(result.neighbours.begin() + result.rowBegin[i], result.neighbours.begin() + result.rowBegin[i + 1],
+                [](const auto& a, const auto& b) {
+                    return a.second != b.second ? a.second > b.second : a.first < b.first;
+                });
+        }
+    });
+
+    return result;
+}
+
+//builds the co-occurrence matrix of every country present in videos
+map<string, TagCooccurrence> buildCountryTagCooccurrence(const vector<Video>& videos, size_t topM) {
+    TRACE_SCOPE("cooccurrence build");
+    map<string, vector<size_t>> rowsByCountry;
+    for (size_t i = 0; i < videos.size(); ++i) {
+        rowsByCountry[videos[i].country].push_back(i);
+    }
+
+    map<string, TagCooccurrence> result;
+    for (const auto& entry : rowsByCountry) {
+        result[entry.first] = buildTagCooccurrence(videos, entry.second, topM, thread::hardware_concurrency());
+    }
+    return result;
+}
+
+//a tag matched by a TagSearchIndex lookup together with its aggregates
+struct TagSearchResult {
+    string tag;
+    int views;
+    int interaction;
+};
+
+//prefix and substring search over every tag seen during ingest. Tags are matched without the
+//double quotes the dataset puts around them, so "mine" finds the tag "minecraft" with its quotes.
+//Tag ids are assigned by rank (most views first, then interaction, then tag order), so the
+//best matches are the smallest ids and a lookup can stop after n of them. The tags sharing a
+//prefix form one range of the tags sorted by text, found by binary search; a segment tree
+//holding the smallest id of every part of that order hands out the range best first.
+//Substring search goes through an n-gram index: every 1-, 2- and 3-byte sequence maps to the
+//increasing ids of the tags containing it, and longer patterns walk the rarest of their
+//trigram lists, checking the others and the text, until they have n matches.
+class TagSearchIndex {
+public:
+    TagSearchIndex() = default;
+
+    //both inputs are sorted by tag, as produced by iterating a map or an in-order BST traversal
+    TagSearchIndex(const vector<pair<string, int>>& tagViews, const vector<pair<string, int>>& tagInteraction) {
+        TRACE_SCOPE("search index build");
+        unordered_map<string_view, int> interactionOf;
+        for (const auto& entry : tagInteraction) {
+            interactionOf.emplace(entry.first, entry.second);
+        }
+        vector<int> lookup(tagViews.size(), 0);
+        for (size_t i = 0; i < tagViews.size(); ++i) {
+            auto it = interactionOf.find(tagViews[i].first);
+            lookup[i] = it == interactionOf.end() ? 0 : it->second;
+        }
+        vector<int> order(tagViews.size());
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            return tagViews[a].second != tagViews[b].second ? tagViews[a].second > tagViews[b].second : lookup[a] > lookup[b];
+            });
+        views.reserve(order.size());
+        interaction.reserve(order.size());
+        for (int i : order) {
+            tags.intern(tagViews[i].first);
+            views.push_back(tagViews[i].second);
+            interaction.push_back(lookup[i]);
+        }
+
+        int count = static_cast<int>(tags.size());
+        byKey.resize(count);
+        iota(byKey.begin(), byKey.end(), 0);
+        sort(byKey.begin(), byKey.end(), [&](int a, int b) {
+            return key(a) != key(b) ? key(a) < key(b) : a < b;
+            });
+        keyPosition.resize(count);
+        rangeBest.resize(2 * static_cast<size_t>(count));
+        for (int i = 0; i < count; ++i) {
+            keyPosition[byKey[i]] = i;
+            rangeBest[count + i] = byKey[i];
+        }
+        for (int i = count - 1; i > 0; --i) {
+            rangeBest[i] = min(rangeBest[2 * i], rangeBest[2 * i + 1]);
+        }
+
+        for (int id = 0; id < count; ++id) {
+            string_view tag = key(id);
+            for (size_t length = 1; length <= 3; ++length) {
+                for (size_t i = 0; i + length <= tag.size(); ++i) {
+                    vector<int>& postings = grams[gramKey(tag.substr(i, length))];
+                    // ids are visited in increasing order, so a repeated gram of this tag is always at the back
+                    if (postings.empty() || postings.back() != id) {
+                        postings.push_back(id);
+                    }
+                }
+            }
+        }
+    }
+
+    size_t size() const { return tags.size(); }
+
+    vector<TagSearchResult> withPrefix(string_view prefix, size_t n) const {
+        prefix = unquoted(prefix);
+        int count = static_cast<int>(byKey.size());
+        int first = 0;
+        int last = count;
+        // lower bound of the prefix, then the end of the run of tags starting with it
+        while (first < last) {
+            int mid = first + (last - first) / 2;
+            if (key(byKey[mid]) < prefix) {
+                first = mid + 1;
+            }
+            else {
+                last = mid;
+            }
+        }
+        last = count;
+        int low = first;
+        while (low < last) {
+            int mid = low + (last - low) / 2;
+            if (key(byKey[mid]).substr(0, prefix.size()) == prefix) {
+                low = mid + 1;
+            }
+            else {
+                last = mid;
+            }
+        }
+
+        // Take the best tag of a range, then split the range around it, n times.
+        struct Range {
+            int best;
+            int first;
+            int last;
+            bool operator<(const Range& other) const { return best > other.best; }
+        };
+        vector<TagSearchResult> result;
+        priority_queue<Range> ranges;
+        if (first < last) {
+            ranges.push({ bestIn(first, last), first, last });
+        }
+        while (!ranges.empty() && result.size() < n) {
+            Range range = ranges.top();
+            ranges.pop();
+            result.push_back(found(range.best));
+            int split = keyPosition[range.best];
+            if (range.first < split) {
+                ranges.push({ bestIn(range.first, split), range.first, split });
+            }
+            if (split + 1 < range.last) {
+                ranges.push({ bestIn(split + 1, range.last), split + 1, range.last });
+            }
+        }
+        return result;
+    }
+
+    vector<TagSearchResult> containing(string_view pattern, size_t n) const {
+        pattern = unquoted(pattern);
+        if (pattern.empty()) {
+            return withPrefix(pattern, n);
+        }
+        vector<TagSearchResult> result;
+        if (pattern.size() <= 3) {
+            auto it = grams.find(gramKey(pattern));
+            if (it != grams.end()) {
+                for (size_t i = 0; i < it->second.size() && result.size() < n; ++i) {
+                    result.push_back(found(it->second[i]));
+                }
+            }
+            return result;
+        }
+
+        // Walk the rarest trigram list, keeping a cursor into each of the others.
+        vector<const vector<int>*> lists;
+        for (size_t i = 0; i + 3 <= pattern.size(); ++i) {
+            auto it = grams.find(gramKey(pattern.substr(i, 3)));
+            if (it == grams.end()) {
+                return result;
+            }
+            lists.push_back(&it->second);
+        }
+        sort(lists.begin(), lists.end(), [](const auto* a, const auto* b) { return a->size() < b->size(); });
+        vector<vector<int>::const_iterator> cursors;
+        for (const vector<int>* list : lists) {
+            cursors.push_back(list->begin());
+        }
+        for (int id : *lists[0]) {
+            bool inAll = true;
+            for (size_t i = 1; i < lists.size() && inAll; ++i) {
+                cursors[i] = lower_bound(cursors[i], lists[i]->end(), id);
+                if (cursors[i] == lists[i]->end()) {
+                    return result;
+                }
+                inAll = *cursors[i] == id;
+            }
+            if (inAll && key(id).find(pattern) != string_view::npos) {
+                result.push_back(found(id));
+                if (result.size() == n) {
+                    break;
+                }
+            }
+        }
+        return result;
+    }
+
+private:
+    TagDictionary tags; // tag id == rank of the tag
+    vector<int> views;
+    vector<int> interaction;
+    vector<int> byKey; // ids sorted by the text they are searched by
+    vector<int> keyPosition; // where an id is in byKey
+    vector<int> rangeBest; // segment tree over byKey, every node the smallest id below it
+    unordered_map<uint32_t, vector<int>> grams;
+
+    //a tag or query without its enclosing double quotes
+    static string_view unquoted(string_view text) {
+        if (!text.empty() && text.front() == '"') {
+            text.remove_prefix(1);
+        }
+        if (!text.empty() && text.back() == '"') {
+            text.remove_suffix(1);
+        }
+        return text;
+    }
+
+    string_view key(int id) const { return unquoted(tags.name(id)); }
+
+    static uint32_t gramKey(string_view gram) {
+        uint32_t key = static_cast<uint32_t>(gram.size()) << 24;
+        for (size_t i = 0; i < gram.size(); ++i) {
+            key |= uint32_t(static_cast<unsigned char>(gram[i])) << (8 * i);
+        }
+        return key;
+    }
+
+    //the smallest id at the positions [first, last) of byKey
+    int bestIn(int first, int last) const {
+        int count = static_cast<int>(byKey.size());
+        int best = INT_MAX;
+        for (first += count, last += count; first < last; first /= 2, last /= 2) {
+            if (first & 1) {
+                best = min(best, rangeBest[first++]);
+            }
+            if (last & 1) {
+                best = min(best, rangeBest[--last]);
+            }
+        }
+        return best;
+    }
+
+    TagSearchResult found(int id) const { return { tags.name(id), views[id], interaction[id] }; }
+};
+
+//how readArchive reads the bytes of the files
+enum class InputMode {
+    stdio, // fread on a read-ahead thread per file
+    uring, // batched reads of all files on one shared io_uring thread (Linux only)
+    uringDirect, // like uring, but bypassing the page cache with O_DIRECT
+};
+
+//checks if a file in the archive is a trending CSV file, raw or compressed (.csv.gz, .csv.zst)
+bool isCsvFile(const fs::path& path) {
+    string extension = path.extension().string();
+    if (extension == ".gz" || extension == ".zst") {
+        extension = path.stem().extension().string();
+    }
+    return extension == ".csv";
+}
+
+//opens the bytes of path the way the input mode asks for, decompressing .gz and .zst files on the fly
+unique_ptr<io::ByteSourceBase> openByteSource(const fs::path& path, InputMode inputMode) {
+    string name = path.string();
+    unique_ptr<io::ByteSourceBase> bytes;
+#if defined(__linux__)
+    if (inputMode != InputMode::stdio) {
+        bytes = io::open_uring_byte_source(name.c_str(), inputMode == InputMode::uringDirect);
+    }
+#endif
+    if (!bytes) {
+        bytes = io::open_file_byte_source(name.c_str());
+    }
+
+    string extension = path.extension().string();
+    if (extension == ".gz") {
+#ifdef CSV_IO_WITH_ZLIB
+        bytes = io::open_gzip_byte_source(name.c_str(), move(bytes));
+#else
+        throw runtime_error("reading .gz files needs a build with CSV_IO_WITH_ZLIB defined and zlib linked");
+#endif
+    }
+    else if (extension == ".zst") {
+#ifdef CSV_IO_WITH_ZSTD
+        bytes = io::open_zstd_byte_source(name.c_str(), move(bytes));
+#else
+        throw runtime_error("reading .zst files needs a build with CSV_IO_WITH_ZSTD defined and libzstd linked");
+#endif
+    }
+    return bytes;
+}
+
+using TrendingReader = io::CSVReader<16, io::trim_chars<' ', '\t'>, io::double_quote_escape<',', '\"'>>;
+
+void readTrendingHeader(TrendingReader& in) {
+    in.read_header(io::ignore_extra_column, "video_id", "trending_date", "title", "channel_title",
+        "category_id", "publish_time", "tags", "views", "likes", "dislikes", "comment_count",
+        "thumbnail_link", "comments_disabled", "ratings_disabled", "video_error_or_removed", "description");
+}
+
+//up to capacity rows of one file stored column by column, filled by readTrendingRows
+struct VideoBatch {
+    static constexpr size_t capacity = 1024;
+
+    string country;
+    size_t size = 0;
+    vector<string> videoIds, trendingDates, publishTimes, tags;
+    vector<string> commentsDisabled, ratingsDisabled, videoErrorOrRemoved;
+    vector<int> categoryIds, views, likes, dislikes, commentCounts;
+
+    VideoBatch() : videoIds(capacity), trendingDates(capacity), publishTimes(capacity), tags(capacity),
+        commentsDisabled(capacity), ratingsDisabled(capacity), videoErrorOrRemoved(capacity),
+        categoryIds(capacity), views(capacity), likes(capacity), dislikes(capacity), commentCounts(capacity) {}
+
+    //moves row i into video, the columns skipped by readTrendingRows stay empty
+    void moveRow(size_t i, Video& video) {
+        video.video_id = move(videoIds[i]);
+        video.trending_date = move(trendingDates[i]);
+        video.category_id = categoryIds[i];
+        video.publish_time = move(publishTimes[i]);
+        video.tags = move(tags[i]);
+        video.views = views[i];
+        video.likes = likes[i];
+        video.dislikes = dislikes[i];
+        video.comment_count = commentCounts[i];
+        video.comments_disabled = (commentsDisabled[i] == "True");
+        video.ratings_disabled = (ratingsDisabled[i] == "True");
+        video.video_error_or_removed = (videoErrorOrRemoved[i] == "True");
+        video.country = country;
+    }
+
+    //appends a copy of video as the next row, the reverse of moveRow
+    void addRow(const Video& video) {
+        videoIds[size] = video.video_id;
+        trendingDates[size] = video.trending_date;
+        categoryIds[size] = video.category_id;
+        publishTimes[size] = video.publish_time;
+        tags[size] = video.tags;
+        views[size] = video.views;
+        likes[size] = video.likes;
+        dislikes[size] = video.dislikes;
+        commentCounts[size] = video.comment_count;
+        commentsDisabled[size] = video.comments_disabled ? "True" : "False";
+        ratingsDisabled[size] = video.ratings_disabled ? "True" : "False";
+        videoErrorOrRemoved[size] = video.video_error_or_removed ? "True" : "False";
+        country = video.country;
+        ++size;
+    }
+
+    //keeps the rows keep(trending date) accepts, in their order
+    template <class Keep>
+    void keepRows(Keep keep) {
+        size_t kept = 0;
+        for (size_t i = 0; i < size; ++i) {
+            if (!keep(trendingDates[i])) {
+                continue;
+            }
+            if (kept != i) {
+                for (vector<string>* column : { &videoIds, &trendingDates, &publishTimes, &tags, &commentsDisabled, &ratingsDisabled, &videoErrorOrRemoved }) {
+                    swap((*column)[kept], (*column)[i]);
+                }
+                for (vector<int>* column : { &categoryIds, &views, &likes, &dislikes, &commentCounts }) {
+                    (*column)[kept] = (*column)[i];
+                }
+            }
+            ++kept;
+        }
+        size = kept;
+    }
+};
+
+//reads the next rows into batch, false at the end of the file. title, channel_title,
+//thumbnail_link and description are not used by any report, they are skipped without being
+//trimmed, unescaped or copied. On a parse error the rows
+//before the bad one are in the batch when the exception is thrown. With onlyReady it stops
+//before a row that would wait for the file to be read, possibly with an empty batch
+bool readTrendingRows(TrendingReader& in, VideoBatch& batch, bool onlyReady = false) {
+    io::skip_column unused;
+    auto readRows = [&](auto... columns) {
+        return onlyReady ? in.read_ready_rows(VideoBatch::capacity, batch.size, columns...)
+            : in.read_rows(VideoBatch::capacity, batch.size, columns...);
+    };
+    return readRows(batch.videoIds.data(), batch.trendingDates.data(),
+        &unused, &unused, batch.categoryIds.data(), batch.publishTimes.data(), batch.tags.data(),
+        batch.views.data(), batch.likes.data(), batch.dislikes.data(), batch.commentCounts.data(), &unused,
+        batch.commentsDisabled.data(), batch.ratingsDisabled.data(), batch.videoErrorOrRemoved.data(), &unused);
+}
+
+//parses all of text as a number of type T, false if it is not one or does not fit; unsigned
+//types do not take a sign
+template <class T>
+bool parseNumber(string_view text, T& value) {
+    const char* end = text.data() + text.size();
+    auto result = from_chars(text.data(), end, value);
+    return result.ec == errc() && result.ptr == end;
+}
+
+//converts a trending date (yy.dd.mm) or an ISO date (yyyy-mm-dd) to yyyymmdd, -1 if it is neither
+int parseDate(const string& date) {
+    int year, month, day;
+    char rest;
+    if (date.size() == 8 && sscanf(date.c_str(), "%2d.%2d.%2d%c", &year, &day, &month, &rest) == 3) {
+        year += 2000;
+    }
+    else if (date.size() != 10 || sscanf(date.c_str(), "%4d-%2d-%2d%c", &year, &month, &day, &rest) != 3) {
+        return -1;
+    }
+    if (month < 1 || month > 12 || day < 1 || day > 31) {
+        return -1;
+    }
+    return year * 10000 + month * 100 + day;
+}
+
+//the country of a trending file, the first two letters of its name
+string fileCountry(const fs::path& path) {
+    return path.filename().string().substr(0, 2);
+}
+
+//the part of the archive a report needs, resolved before ingest: the files of its countries
+//and the rows trending in its date window. Nothing else is read
+struct IngestQuery {
+    set<string> countries; // empty = every country
+    int firstDate = 0; // yyyymmdd
+    int lastDate = INT_MAX;
+    string indexDirectory; // where the date indexes of the files are kept, empty = no date index
+
+    bool wantsFile(const fs::path& path) const { return countries.empty() || countries.count(fileCountry(path)) > 0; }
+    bool hasDateWindow() const { return firstDate > 0 || lastDate < INT_MAX; }
+    bool wantsDate(int date) const { return !hasDateWindow() || (date >= firstDate && date <= lastDate); }
+};
+
+// A date index (<file>.dates) is a text sidecar of a plain CSV file listing its rows as runs of
+// consecutive rows with the same trending date, by byte range, so a date window reads only the
+// runs inside it. The file's size and modification time are stored to tell when it is stale.
+//
+//   "P17D" fileSize modificationTime headerEnd
+//   date begin end                                     one line per run, in file order
+
+struct DateRun {
+    int date; // yyyymmdd, -1 for rows without a valid trending date
+    uint64_t begin;
+    uint64_t end;
+};
+
+struct DateIndex {
+    uint64_t fileSize = 0;
+    long long modificationTime = 0;
+    uint64_t headerEnd = 0;
+    vector<DateRun> runs;
+};
+
+//the date index of a file as it is now, read by parsing only its trending_date column. Throws
+//on a row that does not parse, the index would not cover every row
+DateIndex buildDateIndex(const fs::path& path) {
+    TRACE_SCOPE("date index build");
+    DateIndex index;
+    index.fileSize = fs::file_size(path);
+    index.modificationTime = fs::last_write_time(path).time_since_epoch().count();
+    TrendingReader in(path.string(), io::open_file_byte_source(path.string().c_str()));
+    readTrendingHeader(in);
+    index.headerEnd = in.get_byte_offset();
+    io::skip_column unused;
+    string trendingDate;
+    for (uint64_t begin = index.headerEnd;; begin = in.get_byte_offset()) {
+        if (!in.read_row(unused, trendingDate, unused, unused, unused, unused, unused, unused, unused, unused,
+            unused, unused, unused, unused, unused, unused)) {
+            break;
+        }
+        int date = parseDate(trendingDate);
+        if (!index.runs.empty() && index.runs.back().date == date) {
+            index.runs.back().end = in.get_byte_offset();
+        }
+        else {
+            index.runs.push_back({ date, begin, in.get_byte_offset() });
+        }
+    }
+    return index;
+}
+
+//the date index of path kept in the directory, built and stored there if it is missing or
+//stale. Throws if the file can not be indexed; an index that can not be stored is still used
+DateIndex loadDateIndex(const fs::path& path, const fs::path& directory) {
+    fs::path indexPath = directory / (path.filename().string() + ".dates");
+    uint64_t fileSize = fs::file_size(path);
+    long long modificationTime = fs::last_write_time(path).time_since_epoch().count();
+
+    ifstream stored(indexPath);
+    string magic;
+    DateIndex index;
+    if (stored >> magic >> index.fileSize >> index.modificationTime >> index.headerEnd && magic == "P17D"
+        && index.fileSize == fileSize && index.modificationTime == modificationTime) {
+        DateRun run;
+        while (stored >> run.date >> run.begin >> run.end) {
+            index.runs.push_back(run);
+        }
+        if (stored.eof()) {
+            return index;
+        }
+    }
+
+    index = buildDateIndex(path);
+    ofstream out(indexPath, ios::trunc);
+    out << "P17D " << index.fileSize << " " << index.modificationTime << " " << index.headerEnd << "\n";
+    for (const DateRun& run : index.runs) {
+        out << run.date << " " << run.begin << " " << run.end << "\n";
+    }
+    if (!out.flush()) {
+        cerr << "Can not store the date index " << indexPath << "\n";
+    }
+    return index;
+}
+
+//the header line of a CSV file followed by some byte ranges of its rows, which the readers
+//see as a smaller CSV file
+class FileRangesByteSource : public io::ByteSourceBase {
+public:
+    FileRangesByteSource(const fs::path& path, vector<pair<uint64_t, uint64_t>> ranges) : ranges(move(ranges)) {
+        file.rdbuf()->pubsetbuf(nullptr, 0); // the reader's blocks are the only buffer
+        file.open(path, ios::binary);
+        if (!file) {
+            throw runtime_error("can not open " + path.string());
+        }
+    }
+
+    int read(char* buffer, int size) override {
+        int byteCount = 0;
+        while (byteCount < size && next < ranges.size()) {
+            pair<uint64_t, uint64_t>& range = ranges[next];
+            file.seekg(static_cast<streamoff>(range.first));
+            int length = static_cast<int>(min<uint64_t>(size - byteCount, range.second - range.first));
+            file.read(buffer + byteCount, length);
+            if (file.gcount() != length) {
+                throw runtime_error("the file is shorter than its date index");
+            }
+            byteCount += length;
+            range.first += length;
+            if (range.first == range.second) {
+                ++next;
+            }
+        }
+        return byteCount;
+    }
+
+private:
+    ifstream file;
+    vector<pair<uint64_t, uint64_t>> ranges;
+    size_t next = 0;
+};
+
+//opens the bytes of path for the query: with a date window and a date index, only the header
+//and the runs of rows inside the window of a plain CSV file are read
+unique_ptr<io::ByteSourceBase> openQueryByteSource(const fs::path& path, InputMode inputMode, const IngestQuery& query) {
+    if (!query.hasDateWindow() || query.indexDirectory.empty() || path.extension() != ".csv") {
+        return openByteSource(path, inputMode);
+    }
+    DateIndex index;
+    try {
+        index = loadDateIndex(path, query.indexDirectory);
+    }
+    catch (const exception& e) {
+        cerr << "Can not index the dates of " << path << ", reading all of it: " << e.what() << "\n";
+        return openByteSource(path, inputMode);
+    }
+    vector<pair<uint64_t, uint64_t>> ranges = { { 0, index.headerEnd } };
+    uint64_t rowBytes = 0;
+    for (const DateRun& run : index.runs) {
+        if (query.wantsDate(run.date)) {
+            if (ranges.back().second == run.begin) {
+                ranges.back().second = run.end;
+            }
+            else {
+                ranges.emplace_back(run.begin, run.end);
+            }
+            rowBytes += run.end - run.begin;
+        }
+    }
+    TRACE_COUNT("bytes skipped by date indexes", index.fileSize - index.headerEnd - rowBytes);
+    return make_unique<FileRangesByteSource>(path, move(ranges));
+}
+
+//reads every CSV file in the folder that acceptFile(path) accepts and calls onVideo(video,
+//engagement) for each of its rows in the date window of the query. The files are read one after
+//the other by one I/O thread into the same two block buffers, instead of a new thread and new
+//buffers per file. Rows are parsed a VideoBatch at a time and scored together by scoreEngagement
+template <class Accept, class F>
+void readArchive(const string& foldername, InputMode inputMode, const IngestQuery& query, Accept acceptFile, F onVideo) {
+    io::IOThreadPool ioThreads(1);
+    io::BlockBufferPool blockBuffers(2);
+    for (const auto& entry : fs::directory_iterator(foldername)) {
+        if (!isCsvFile(entry.path())) {
+            continue;
+        }
+        if (!acceptFile(entry.path())) {
+            TRACE_COUNT("files skipped", 1);
+            continue;
+        }
+        TRACE_SCOPE("read file");
+        try {
+            TrendingReader in(entry.path().string(), openQueryByteSource(entry.path(), inputMode, query),
+                io::ReadPools{ &ioThreads, &blockBuffers });
+            readTrendingHeader(in);
+
+            VideoBatch batch;
+            batch.country = fileCountry(entry.path());
+            double engagement[VideoBatch::capacity];
+            Video video;
+            bool more = true;
+            while (more) {
+                string parseError;
+                try {
+                    more = readTrendingRows(in, batch) && batch.size == VideoBatch::capacity;
+                }
+                catch (const std::exception& e) {
+                    // the rows before the bad one are still handed on
+                    parseError = e.what();
+                    more = false;
+                }
+                if (query.hasDateWindow()) {
+                    batch.keepRows([&](const string& date) { return query.wantsDate(parseDate(date)); });
+                }
+                scoreEngagement(batch.likes.data(), batch.dislikes.data(), batch.commentCounts.data(), batch.views.data(),
+                    batch.size, engagementWeights, engagement);
+                for (size_t i = 0; i < batch.size; ++i) {
+                    batch.moveRow(i, video);
+                    onVideo(video, engagement[i]);
+                }
+                if (!parseError.empty()) {
+                    TRACE_COUNT("rows rejected", 1);
+                    cerr << "Error parsing a line in file " << entry.path() << ": " << parseError << "\n";
+                }
+            }
+        }
+        catch (const std::exception& e) {
+            cerr << "Error parsing file " << entry.path() << ": " << e.what() << "\n";
+            continue;
+        }
+    }
+    TRACE_COUNT("read block buffers", blockBuffers.allocated_count());
+}
+
+//reads every CSV file in the folder that acceptFile(path) accepts and calls onVideo(video,
+//engagement) for each of its rows
+template <class Accept, class F>
+void readArchive(const string& foldername, InputMode inputMode, Accept acceptFile, F onVideo) {
+    readArchive(foldername, inputMode, IngestQuery(), acceptFile, onVideo);
+}
+
+//reads every CSV file in the folder and calls onVideo(video, engagement) for each of its rows
+template <class F>
+void readArchive(const string& foldername, InputMode inputMode, F onVideo) {
+    readArchive(foldername, inputMode, [](const fs::path&) { return true; }, onVideo);
+}
+
+////////////////////////////////////////////////////////////////////////////
+//                             Columnar export                            //
+////////////////////////////////////////////////////////////////////////////
+
+// P17C files hold a table column by column, in batches of rows, so dataframe tools can load
+// each column as one array without parsing text. All integers are little-endian.
+//
+//   file       = "P17C" u32 version(1) u32 columnCount column{columnCount} batch* end
+//   column     = u8 type u32 nameLength name
+//   batch      = u32 rowCount(> 0) chunk{columnCount}, the chunks in column order
+//   end        = u32 0 u64 totalRowCount "P17C"
+//
+// The chunk of a batch depends on the type of its column:
+//   1 int32      i32 value{rowCount}
+//   2 boolean    u8 value{rowCount}, 0 or 1
+//   3 utf8       u32 offset{rowCount + 1} bytes{offset[rowCount]}; value i is bytes[offset[i], offset[i + 1])
+//   4 dictionary u32 newEntryCount (u32 length bytes{length}){newEntryCount} u32 id{rowCount}
+//                The new entries extend the dictionary of the column, which starts empty and
+//                carries over from batch to batch; id i is the position of a value in it.
+//
+// A file without the end marker was cut short; its complete batches are still valid.
+class ColumnarWriter {
+public:
+    enum Type : uint8_t { int32 = 1, boolean = 2, utf8 = 3, dictionary = 4 };
+
+    //creates the file and writes its header. Throws runtime_error if it can not be created
+    ColumnarWriter(const fs::path& path, vector<pair<string, Type>> columns)
+        : path(path), file(fopen(path.string().c_str(), "wb"), fclose), out(file.get()), columns(move(columns)),
+        dictionaries(this->columns.size()) {
+        if (!file) {
+            throw runtime_error("can not create " + path.string() + ": " + strerror(errno));
+        }
+        setvbuf(file.get(), nullptr, _IONBF, 0); // the writer's buffer is the only one
+        out << "P17C";
+        put32(1);
+        put32(static_cast<uint32_t>(this->columns.size()));
+        for (const auto& column : this->columns) {
+            out << static_cast<char>(column.second);
+            put32(static_cast<uint32_t>(column.first.size()));
+            out << column.first;
+        }
+    }
+
+    //starts a batch of rowCount rows; a chunk for every column has to follow, in column order.
+    //Every chunk calls value(i) once or twice for each row i
+    void beginBatch(size_t rowCount) {
+        put32(static_cast<uint32_t>(rowCount));
+        batchRows = rowCount;
+        totalRows += rowCount;
+        column = 0;
+    }
+
+    template <class F>
+    void int32Column(F value) {
+        nextColumn(int32);
+        for (size_t i = 0; i < batchRows; ++i) {
+            put32(static_cast<uint32_t>(value(i)));
+        }
+    }
+
+    template <class F>
+    void booleanColumn(F value) {
+        nextColumn(boolean);
+        for (size_t i = 0; i < batchRows; ++i) {
+            out << static_cast<char>(value(i) ? 1 : 0);
+        }
+    }
+
+    template <class F>
+    void utf8Column(F value) {
+        nextColumn(utf8);
+        uint32_t offset = 0;
+        put32(offset);
+        for (size_t i = 0; i < batchRows; ++i) {
+            offset += static_cast<uint32_t>(string_view(value(i)).size());
+            put32(offset);
+        }
+        for (size_t i = 0; i < batchRows; ++i) {
+            out << string_view(value(i));
+        }
+    }
+
+    template <class F>
+    void dictionaryColumn(F value) {
+        Dictionary& entries = dictionaries[column];
+        nextColumn(dictionary);
+        ids.clear();
+        newEntries.clear();
+        for (size_t i = 0; i < batchRows; ++i) {
+            string_view v = value(i);
+            auto it = entries.ids.find(v);
+            if (it == entries.ids.end()) {
+                entries.values.emplace_back(v);
+                it = entries.ids.emplace(entries.values.back(), static_cast<uint32_t>(entries.ids.size())).first;
+                newEntries.push_back(v);
+            }
+            ids.push_back(it->second);
+        }
+        put32(static_cast<uint32_t>(newEntries.size()));
+        for (string_view entry : newEntries) {
+            put32(static_cast<uint32_t>(entry.size()));
+            out << entry;
+        }
+        for (uint32_t id : ids) {
+            put32(id);
+        }
+    }
+
+    //writes the end marker and flushes. Throws runtime_error if anything could not be written
+    void finish() {
+        put32(0);
+        put32(static_cast<uint32_t>(totalRows));
+        put32(static_cast<uint32_t>(totalRows >> 32));
+        out << "P17C";
+        out.flush();
+        if (out.failed()) {
+            throw runtime_error("can not write " + path.string() + ": " + strerror(errno));
+        }
+    }
+
+    uint64_t rowCount() const { return totalRows; }
+
+private:
+    void put32(uint32_t value) {
+        char bytes[4] = { static_cast<char>(value), static_cast<char>(value >> 8), static_cast<char>(value >> 16),
+            static_cast<char>(value >> 24) };
+        out << string_view(bytes, 4);
+    }
+
+    void nextColumn(Type type) {
+        if (column >= columns.size() || columns[column].second != type) {
+            throw logic_error("P17C chunk does not match the column " + to_string(column) + " of " + path.string());
+        }
+        ++column;
+    }
+
+    //values of a dictionary column so far; the deque keeps them in place for the views
+    struct Dictionary {
+        deque<string> values;
+        unordered_map<string_view, uint32_t> ids;
+    };
+
+    fs::path path;
+    unique_ptr<FILE, int (*)(FILE*)> file;
+    ReportWriter out; // declared after file, so it flushes before the file is closed
+    vector<pair<string, Type>> columns;
+    vector<Dictionary> dictionaries;
+    size_t column = 0;
+    size_t batchRows = 0;
+    uint64_t totalRows = 0;
+    vector<uint32_t> ids;
+    vector<string_view> newEntries;
+};
+
+//streams the parsed videos to videos.p17c while the archive is ingested, one batch at a time.
+//Video ids, countries and trending dates repeat from row to row and are dictionary encoded.
+//Any thread may write; batches are written whole, in the order they come in
+class ColumnarVideoExport {
+public:
+    explicit ColumnarVideoExport(const fs::path& directory)
+        : writer(directory / "videos.p17c", {
+            { "video_id", ColumnarWriter::dictionary }, { "country", ColumnarWriter::dictionary },
+            { "trending_date", ColumnarWriter::dictionary }, { "category_id", ColumnarWriter::int32 },
+            { "publish_time", ColumnarWriter::utf8 }, { "tags", ColumnarWriter::utf8 },
+            { "views", ColumnarWriter::int32 }, { "likes", ColumnarWriter::int32 },
+            { "dislikes", ColumnarWriter::int32 }, { "comment_count", ColumnarWriter::int32 },
+            { "comments_disabled", ColumnarWriter::boolean }, { "ratings_disabled", ColumnarWriter::boolean },
+            { "video_error_or_removed", ColumnarWriter::boolean } }) {}
+
+    //writes the rows of a batch; call it before the rows are moved out of the batch
+    void write(const VideoBatch& batch) {
+        TRACE_SCOPE("columnar write batch");
+        lock_guard<mutex> lock(writerMutex);
+        writer.beginBatch(batch.size);
+        writer.dictionaryColumn([&](size_t i) { return string_view(batch.videoIds[i]); });
+        writer.dictionaryColumn([&](size_t) { return string_view(batch.country); });
+        writer.dictionaryColumn([&](size_t i) { return string_view(batch.trendingDates[i]); });
+        writer.int32Column([&](size_t i) { return batch.categoryIds[i]; });
+        writer.utf8Column([&](size_t i) { return string_view(batch.publishTimes[i]); });
+        writer.utf8Column([&](size_t i) { return string_view(batch.tags[i]); });
+        writer.int32Column([&](size_t i) { return batch.views[i]; });
+        writer.int32Column([&](size_t i) { return batch.likes[i]; });
+        writer.int32Column([&](size_t i) { return batch.dislikes[i]; });
+        writer.int32Column([&](size_t i) { return batch.commentCounts[i]; });
+        writer.booleanColumn([&](size_t i) { return batch.commentsDisabled[i] == "True"; });
+        writer.booleanColumn([&](size_t i) { return batch.ratingsDisabled[i] == "True"; });
+        writer.booleanColumn([&](size_t i) { return batch.videoErrorOrRemoved[i] == "True"; });
+    }
+
+    //collects single videos and writes them a full batch at a time
+    void add(const Video& video) {
+        if (pending.size != 0 && (pending.size == VideoBatch::capacity || pending.country != video.country)) {
+            write(pending);
+            pending.size = 0;
+        }
+        pending.addRow(video);
+    }
+
+    //writes the rows still pending and the end of the file
+    uint64_t finish() {
+        if (pending.size != 0) {
+            write(pending);
+            pending.size = 0;
+        }
+        writer.finish();
+        return writer.rowCount();
+    }
+
+private:
+    mutex writerMutex;
+    ColumnarWriter writer;
+    VideoBatch pending;
+};
+
+//writes the views and interaction of every tag to tags.p17c, one row per country and tag,
+//with "all" as the country of the totals over every country. Returns the number of rows
+uint64_t exportColumnarTags(const fs::path& directory, const vector<pair<string, vector<pair<string, int>>>>& views,
+    const vector<pair<string, vector<pair<string, int>>>>& interaction) {
+    ColumnarWriter writer(directory / "tags.p17c", {
+        { "country", ColumnarWriter::dictionary }, { "tag", ColumnarWriter::utf8 },
+        { "views", ColumnarWriter::int32 }, { "interaction", ColumnarWriter::int32 } });
+    for (size_t c = 0; c < views.size(); ++c) {
+        // both tables of a country hold the same tags in the same (sorted) order
+        const string& country = views[c].first;
+        const vector<pair<string, int>>& tagViews = views[c].second;
+        const vector<pair<string, int>>& tagInteraction = interaction[c].second;
+        if (interaction[c].first != country || tagInteraction.size() != tagViews.size()) {
+            throw logic_error("the views and interaction tables of " + country + " hold different tags");
+        }
+        for (size_t first = 0; first < tagViews.size(); first += VideoBatch::capacity) {
+            size_t rowCount = min(VideoBatch::capacity, tagViews.size() - first);
+            writer.beginBatch(rowCount);
+            writer.dictionaryColumn([&](size_t) { return string_view(country); });
+            writer.utf8Column([&](size_t i) { return string_view(tagViews[first + i].first); });
+            writer.int32Column([&](size_t i) { return tagViews[first + i].second; });
+            writer.int32Column([&](size_t i) { return tagInteraction[first + i].second; });
+        }
+    }
+    writer.finish();
+    return writer.rowCount();
+}
+
+////////////////////////////////////////////////////////////////////////////
+//                          Resident query server                         //
+////////////////////////////////////////////////////////////////////////////
+
+//views and interaction of one tag, summed over some rows
+struct TagTotals {
+    int tag;
+    long long views;
+    long long interaction;
+};
+
+//everything needed to answer ranking queries about one country
+struct CountryQueryIndex {
+    vector<int> dates; // distinct trending dates (yyyymmdd), ascending
+    vector<vector<TagTotals>> dayTotals; // per date, sorted by tag id
+    vector<TagTotals> totals; // over all dates, sorted by tag id
+    vector<int> byViews; // indices into totals, most views first
+    vector<int> byInteraction; // indices into totals, most interaction first
+};
+
+//immutable state the server answers from; a refresh builds a new one next to it
+struct QuerySnapshot {
+    TagDictionary tags;
+    map<string, CountryQueryIndex> countries;
+    size_t videoCount = 0;
+};
+
+//holds the current snapshot of a T for any number of lock-free readers and one writer.
+//Readers announce themselves in one of two counters selected by the epoch; the writer swaps
+//the pointer, then flips the epoch twice, waiting for each counter to drain, before it frees
+//the old snapshot. Readers never wait; only the writer does.
+template <class T>
+class SnapshotPublisher {
+public:
+    class Reader {
+    public:
+        Reader(const SnapshotPublisher& publisher) : counter(publisher.readers[publisher.epoch.load() & 1]) {
+            counter.fetch_add(1);
+            snapshot = publisher.current.load();
+        }
+        ~Reader() { counter.fetch_sub(1); }
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        const T* get() const { return snapshot; }
+        const T* operator->() const { return snapshot; }
+
+    private:
+        atomic<long>& counter;
+        const T* snapshot;
+    };
+
+    ~SnapshotPublisher() { delete current.load(); }
+
+    Reader read() const { return Reader(*this); }
+
+    //only one thread may publish at a time
+    void publish(unique_ptr<const T> next) {
+        const T* previous = current.exchange(next.release());
+        for (int flip = 0; flip < 2; ++flip) {
+            unsigned oldEpoch = epoch.fetch_add(1);
+            while (readers[oldEpoch & 1].load() != 0) {
+                this_thread::yield();
+            }
+        }
+        delete previous;
+    }
+
+private:
+    atomic<const T*> current{ nullptr };
+    atomic<unsigned> epoch{ 0 };
+    mutable atomic<long> readers[2] = { {0}, {0} };
+};
+
+unique_ptr<const QuerySnapshot> buildQuerySnapshot(const string& foldername, InputMode inputMode) {
+    TRACE_SCOPE("snapshot build");
+    auto snapshot = make_unique<QuerySnapshot>();
+    // country -> date -> tag id -> totals
+    map<string, map<int, unordered_map<int, TagTotals>>> days;
+
+    readArchive(foldername, inputMode, [&](const Video& video, double engagement) {
+        ++snapshot->videoCount;
+        auto& day = days[video.country][parseDate(video.trending_date)];
+        forEachFoldedTag(video.tags, [&](string_view tag) {
+            int id = snapshot->tags.intern(tag);
+            TagTotals& totals = day.emplace(id, TagTotals{ id, 0, 0 }).first->second;
+            totals.views += video.views;
+            totals.interaction += static_cast<long long>(engagement * video.views);
+        });
+        });
+
+    for (auto& country : days) {
+        CountryQueryIndex& index = snapshot->countries[country.first];
+        unordered_map<int, TagTotals> all;
+        for (auto& day : country.second) {
+            vector<TagTotals> totals;
+            for (const auto& entry : day.second) {
+                totals.push_back(entry.second);
+                TagTotals& sum = all.emplace(entry.first, TagTotals{ entry.first, 0, 0 }).first->second;
+                sum.views += entry.second.views;
+                sum.interaction += entry.second.interaction;
+            }
+            sort(totals.begin(), totals.end(), [](const auto& a, const auto& b) { return a.tag < b.tag; });
+            index.dates.push_back(day.first);
+            index.dayTotals.push_back(move(totals));
+        }
+        for (const auto& entry : all) {
+            index.totals.push_back(entry.second);
+        }
+        sort(index.totals.begin(), index.totals.end(), [](const auto& a, const auto& b) { return a.tag < b.tag; });
+
+        index.byViews.resize(index.totals.size());
+        for (size_t i = 0; i < index.byViews.size(); ++i) {
+            index.byViews[i] = static_cast<int>(i);
+        }
+        index.byInteraction = index.byViews;
+        sort(index.byViews.begin(), index.byViews.end(), [&](int a, int b) {
+            return index.totals[a].views != index.totals[b].views ? index.totals[a].views > index.totals[b].views : a < b;
+            });
+        sort(index.byInteraction.begin(), index.byInteraction.end(), [&](int a, int b) {
+            return index.totals[a].interaction != index.totals[b].interaction ? index.totals[a].interaction > index.totals[b].interaction : a < b;
+            });
+    }
+    return snapshot;
+}
+
+//answers one request line:
+//  COUNTRIES
+//  TOP <country> <k> <views|interaction|avoid-views|avoid-interaction> [<from> <to>]
+//Dates are yy.dd.mm like trending_date, or yyyy-mm-dd. The response ends with an empty line.
+string answerQuery(const QuerySnapshot& snapshot, const string& request) {
+    stringstream in(request);
+    string command;
+    in >> command;
+    transform(command.begin(), command.end(), command.begin(), ::toupper);
+    ostringstream out;
+
+    if (command == "COUNTRIES") {
+        for (const auto& country : snapshot.countries) {
+            out << country.first << "\n";
+        }
+        out << "\n";
+        return out.str();
+    }
+    if (command != "TOP") {
+        return "ERROR unknown command \"" + command + "\"\n\n";
+    }
+
+    string country, count, metric, from, to;
+    in >> country >> count >> metric >> from >> to;
+    transform(country.begin(), country.end(), country.begin(), ::toupper);
+    auto it = snapshot.countries.find(country);
+    if (it == snapshot.countries.end()) {
+        return "ERROR unknown country \"" + country + "\"\n\n";
+    }
+    size_t k = 0;
+    if (!parseNumber(count, k)) {
+        return "ERROR the count must be a non-negative number, got \"" + count + "\"\n\n";
+    }
+    bool ascending = metric.rfind("avoid-", 0) == 0;
+    string measure = ascending ? metric.substr(6) : metric;
+    if (measure != "views" && measure != "interaction") {
+        return "ERROR unknown metric \"" + metric + "\"\n\n";
+    }
+    bool byViews = measure == "views";
+    auto value = [&](const TagTotals& totals) { return byViews ? totals.views : totals.interaction; };
+    const CountryQueryIndex& index = it->second;
+
+    vector<TagTotals> ranking;
+    if (from.empty()) {
+        const vector<int>& order = byViews ? index.byViews : index.byInteraction;
+        size_t count = min(k, order.size());
+        for (size_t i = 0; i < count; ++i) {
+            ranking.push_back(index.totals[ascending ? order[order.size() - 1 - i] : order[i]]);
+        }
+    }
+    else {
+        int first = parseDate(from);
+        int last = to.empty() ? first : parseDate(to);
+        if (first < 0 || last < 0) {
+            return "ERROR dates must be yy.dd.mm or yyyy-mm-dd\n\n";
+        }
+        unordered_map<int, TagTotals> sums;
+        auto day = lower_bound(index.dates.begin(), index.dates.end(), first);
+        for (; day != index.dates.end() && *day <= last; ++day) {
+            for (const TagTotals& totals : index.dayTotals[day - index.dates.begin()]) {
+                TagTotals& sum = sums.emplace(totals.tag, TagTotals{ totals.tag, 0, 0 }).first->second;
+                sum.views += totals.views;
+                sum.interaction += totals.interaction;
+            }
+        }
+        for (const auto& entry : sums) {
+            ranking.push_back(entry.second);
+        }
+        auto better = [&](const TagTotals& a, const TagTotals& b) {
+            if (value(a) != value(b)) {
+                return ascending ? value(a) < value(b) : value(a) > value(b);
+            }
+            return ascending ? a.tag > b.tag : a.tag < b.tag;
+        };
+        size_t count = min(k, ranking.size());
+        partial_sort(ranking.begin(), ranking.begin() + count, ranking.end(), better);
+        ranking.resize(count);
+    }
+
+    for (const TagTotals& totals : ranking) {
+        out << snapshot.tags.name(totals.tag) << "\t" << value(totals) << "\n";
+    }
+    out << "\n";
+    return out.str();
+}
+
+#ifndef _WIN32
+//serves queries on a Unix socket until the process is killed. Every connection gets its own
+//thread; REFRESH re-ingests the archive in the background and publishes a new snapshot
+//while the old one keeps answering.
+int runQueryServer(const string& foldername, InputMode inputMode, const string& socketPath) {
+    SnapshotPublisher<QuerySnapshot> publisher;
+    atomic<bool> refreshing{ false };
+
+    auto refresh = [&] {
+        auto refreshStart = chrono::high_resolution_clock::now();
+        auto snapshot = buildQuerySnapshot(foldername, inputMode);
+        size_t videoCount = snapshot->videoCount;
+        publisher.publish(move(snapshot));
+        auto refreshEnd = chrono::high_resolution_clock::now();
+        cout << "Published a snapshot of " << videoCount << " videos in "
+            << chrono::duration_cast<chrono::milliseconds>(refreshEnd - refreshStart).count() << " milliseconds" << endl;
+    };
+    refresh();
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (listener < 0 || socketPath.size() >= sizeof(address.sun_path)) {
+        cerr << "Can not create the socket " << socketPath << "\n";
+        return 1;
+    }
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    unlink(socketPath.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        cerr << "Can not listen on " << socketPath << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+    cout << "Listening on " << socketPath << endl;
+
+    for (;;) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // these last until connections close, retrying at once would only spin
+                this_thread::sleep_for(chrono::milliseconds(100));
+                continue;
+            }
+            cerr << "Can not accept connections on " << socketPath << ": " << strerror(errno) << "\n";
+            exit(1);
+        }
+        thread([&, connection] {
+            string pending;
+            char buffer[4096];
+            ssize_t received;
+            while ((received = recv(connection, buffer, sizeof(buffer), 0)) > 0) {
+                pending.append(buffer, received);
+                size_t lineEnd;
+                while ((lineEnd = pending.find('\n')) != string::npos) {
+                    string request = pending.substr(0, lineEnd);
+                    pending.erase(0, lineEnd + 1);
+                    if (!request.empty() && request.back() == '\r') {
+                        request.pop_back();
+                    }
+
+                    string response;
+                    string command = request.substr(0, request.find(' '));
+                    transform(command.begin(), command.end(), command.begin(), ::toupper);
+                    if (command == "QUIT") {
+                        close(connection);
+                        return;
+                    }
+                    else if (command == "REFRESH") {
+                        if (refreshing.exchange(true)) {
+                            response = "ERROR a refresh is already running\n\n";
+                        }
+                        else {
+                            thread([&] {
+                                // a failed refresh keeps the published snapshot, the server must not go down with it
+                                try {
+                                    refresh();
+                                }
+                                catch (const exception& e) {
+                                    cerr << "Refresh failed, still serving the previous snapshot: " << e.what() << endl;
+                                }
+                                refreshing = false;
+                                }).detach();
+                            response = "OK refresh started\n\n";
+                        }
+                    }
+                    else {
+                        auto snapshot = publisher.read();
+                        response = answerQuery(*snapshot.get(), request);
+                    }
+                    for (size_t sent = 0; sent < response.size();) {
+                        ssize_t written = send(connection, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                        if (written <= 0) {
+                            close(connection);
+                            return;
+                        }
+                        sent += written;
+                    }
+                }
+            }
+            close(connection);
+            }).detach();
+    }
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+//                            Ingest pipeline                             //
+////////////////////////////////////////////////////////////////////////////
+
+//throughput counters of one pipeline stage, shared by all threads of the stage
+struct StageStats {
+    atomic<long long> items{ 0 };
+    atomic<long long> units{ 0 }; // bytes for the read stage, rows for the others
+    atomic<long long> busyNanos{ 0 };
+    atomic<long long> waitNanos{ 0 }; // blocked on a full output or an empty input queue
+};
+
+//waits a little longer on every call: spinning first, then yielding, then sleeping
+class Backoff {
+public:
+    void pause() {
+        if (++rounds < 64) {
+            this_thread::yield();
+        }
+        else {
+            this_thread::sleep_for(chrono::microseconds(50));
+        }
+    }
+
+private:
+    int rounds = 0;
+};
+
+//bounded multi-producer multi-consumer queue. Every cell carries a sequence number telling
+//producers and consumers whose turn it is, so a push or pop is one compare-and-swap on the
+//shared position and never takes a lock. A full queue makes producers wait, which is what
+//keeps a fast stage from running ahead of a slow one.
+template <class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t minimumCapacity) {
+        size_t capacity = 2;
+        while (capacity < minimumCapacity) {
+            capacity *= 2;
+        }
+        cells = vector<Cell>(capacity);
+        for (size_t i = 0; i < capacity; ++i) {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+        mask = capacity - 1;
+    }
+
+    bool tryPush(T& item) {
+        size_t position = pushPosition.load(memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            if (sequence == position) {
+                if (pushPosition.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    cell.item = move(item);
+                    cell.sequence.store(position + 1, memory_order_release);
+                    return true;
+                }
+            }
+            else if (sequence < position) {
+                return false; // full
+            }
+            else {
+                position = pushPosition.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    bool tryPop(T& item) {
+        size_t position = popPosition.load(memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            if (sequence == position + 1) {
+                if (popPosition.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    item = move(cell.item);
+                    cell.sequence.store(position + mask + 1, memory_order_release);
+                    return true;
+                }
+            }
+            else if (sequence < position + 1) {
+                return false; // empty
+            }
+            else {
+                position = popPosition.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    void push(T item, StageStats& stats) {
+        if (tryPush(item)) {
+            return;
+        }
+        auto waitStart = chrono::steady_clock::now();
+        Backoff backoff;
+        while (!tryPush(item)) {
+            backoff.pause();
+        }
+        stats.waitNanos += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - waitStart).count();
+    }
+
+    //false once the queue is closed and drained
+    bool pop(T& item, StageStats& stats) {
+        if (tryPop(item)) {
+            return true;
+        }
+        auto waitStart = chrono::steady_clock::now();
+        Backoff backoff;
+        bool popped;
+        while (!(popped = tryPop(item))) {
+            if (closed.load(memory_order_acquire)) {
+                popped = tryPop(item);
+                break;
+            }
+            backoff.pause();
+        }
+        stats.waitNanos += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - waitStart).count();
+        return popped;
+    }
+
+    //called by the last producer once it has pushed everything
+    void close() { closed.store(true, memory_order_release); }
+
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        T item;
+    };
+
+    vector<Cell> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> pushPosition{ 0 };
+    alignas(64) atomic<size_t> popPosition{ 0 };
+    atomic<bool> closed{ false };
+};
+
+//whole lines of one file, preceded by its header line so every block can be parsed on its own
+struct InputBlock {
+    string fileName;
+    string country;
+    unsigned firstLine = 0; // line number of the first row in the file
+    string bytes;
+};
+
+//tag aggregates of one aggregator thread, merged into the global ones at the end
+struct TagAggregates {
+    map<string, TagTable> countryTagViews;
+    map<string, TagTable> countryTagInteractions;
+    vector<Video> videos;
+    TagStatsTables tagStats;
+};
+
+//folds a batch into thread-local tag aggregates, moving its rows into them, after handing it to
+//columnar if there is one
+void aggregateBatch(VideoBatch& batch, TagAggregates& partial, ColumnarVideoExport* columnar, bool keepTagStats) {
+    double engagement[VideoBatch::capacity];
+    scoreEngagement(batch.likes.data(), batch.dislikes.data(), batch.commentCounts.data(), batch.views.data(),
+        batch.size, engagementWeights, engagement);
+    if (columnar) {
+        columnar->write(batch);
+    }
+    for (size_t i = 0; i < batch.size; ++i) {
+        Video video;
+        batch.moveRow(i, video);
+        updateTagViewsAndInteractions(video, engagement[i], partial.countryTagViews, partial.countryTagInteractions);
+        if (keepTagStats) {
+            updateTagStats(video, partial.tagStats);
+        }
+        partial.videos.push_back(move(video));
+    }
+}
+
+//merges the thread-local tag aggregates into the tables, or the trees for the BST report, and
+//moves their videos to videos
+void mergeTagAggregates(vector<TagAggregates>& partials, const string& dataStructure, vector<Video>& videos,
+    TreeNode*& countryTagViewsRoot, TreeNode*& countryTagInteractionsRoot, pmr::memory_resource& treeArena, TagStatsTables* tagStats) {
+    vector<pair<string_view, int>> treeViews;
+    vector<pair<string_view, int>> treeInteractions;
+    for (TagAggregates& partial : partials) {
+        for (Video& video : partial.videos) {
+            videos.push_back(move(video));
+        }
+        if (tagStats) {
+            tagStats->merge(partial.tagStats);
+        }
+        if (dataStructure == "map") {
+            for (const auto& country : partial.countryTagViews) {
+                for (const auto& entry : country.second) {
+                    countryTagViews[country.first][entry.first] += entry.second;
+                }
+            }
+            for (const auto& country : partial.countryTagInteractions) {
+                for (const auto& entry : country.second) {
+                    countryTagInteractions[country.first][entry.first] += entry.second;
+                }
+            }
+        }
+        else {
+            // the BST report keeps one tree for all countries, built once all entries are in
+            for (const auto& country : partial.countryTagViews) {
+                for (const auto& entry : country.second) {
+                    treeViews.emplace_back(entry.first, entry.second);
+                }
+            }
+            for (const auto& country : partial.countryTagInteractions) {
+                for (const auto& entry : country.second) {
+                    treeInteractions.emplace_back(entry.first, entry.second);
+                }
+            }
+        }
+    }
+    if (dataStructure != "map") {
+        countryTagViewsRoot = mergeIntoTree(countryTagViewsRoot, move(treeViews), treeArena);
+        countryTagInteractionsRoot = mergeIntoTree(countryTagInteractionsRoot, move(treeInteractions), treeArena);
+    }
+}
+
+struct PipelineThreads {
+    unsigned read = 1;
+    unsigned parse = 0; // 0 = the cores the other stages leave
+    unsigned aggregate = 1;
+};
+
+//ingests the part of the archive the query wants in three stages connected by bounded queues:
+//read threads cut the files into blocks of whole lines, parse threads turn blocks into row
+//batches and aggregate threads fold the batches into thread-local tag aggregates, which are
+//merged at the end. The aggregate threads also hand every batch to columnar and keep tag
+//statistics for tagStats, if there are
+void runIngestPipeline(const string& foldername, InputMode inputMode, const IngestQuery& query, PipelineThreads threads, const string& dataStructure,
+    vector<Video>& videos, TreeNode*& countryTagViewsRoot, TreeNode*& countryTagInteractionsRoot, pmr::memory_resource& treeArena,
+    ColumnarVideoExport* columnar, TagStatsTables* tagStats) {
+    const size_t blockLength = 512 * 1024; // stays below the csv.h block, so parsing a block starts no thread
+
+    if (threads.parse == 0) {
+        unsigned cores = max(1u, thread::hardware_concurrency());
+        threads.parse = cores > threads.read + threads.aggregate ? cores - threads.read - threads.aggregate : 1;
+    }
+
+    vector<fs::path> files;
+    for (const auto& entry : fs::directory_iterator(foldername)) {
+        if (isCsvFile(entry.path()) && query.wantsFile(entry.path())) {
+            files.push_back(entry.path());
+        }
+        else if (isCsvFile(entry.path())) {
+            TRACE_COUNT("files skipped", 1);
+        }
+    }
+
+    BoundedQueue<InputBlock> blocks(4 * threads.parse);
+    BoundedQueue<VideoBatch> batches(4 * threads.aggregate);
+    StageStats readStats, parseStats, aggregateStats;
+    atomic<size_t> nextFile{ 0 };
+    atomic<unsigned> activeReaders{ threads.read };
+    atomic<unsigned> activeParsers{ threads.parse };
+    vector<TagAggregates> partials(threads.aggregate);
+
+    auto busySince = [](chrono::steady_clock::time_point start, StageStats& stats) {
+        stats.busyNanos += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    };
+
+    // A block fits into one reader buffer, a line longer than the rest of the block needs a second
+    io::BlockBufferPool parseBuffers(2 * threads.parse);
+
+    vector<thread> workers;
+    for (unsigned t = 0; t < threads.read; ++t) {
+        workers.emplace_back([&] {
+            for (size_t file; (file = nextFile++) < files.size();) {
+                const fs::path& path = files[file];
+                auto start = chrono::steady_clock::now();
+                try {
+                    unique_ptr<io::ByteSourceBase> source = openQueryByteSource(path, inputMode, query);
+                    string header;
+                    string carry; // bytes after the last complete line
+                    unsigned line = 2;
+                    bool endOfFile = false;
+                    while (!endOfFile) {
+                        InputBlock block;
+                        block.fileName = path.string();
+                        block.country = fileCountry(path);
+                        block.firstLine = line;
+                        block.bytes = header;
+                        block.bytes += carry;
+                        size_t dataBegin = block.bytes.size();
+                        block.bytes.resize(dataBegin + blockLength);
+                        int byteCount = source->read(&block.bytes[dataBegin], static_cast<int>(blockLength));
+                        block.bytes.resize(dataBegin + byteCount);
+                        readStats.units += byteCount;
+                        TRACE_COUNT("pipeline bytes read", byteCount);
+                        endOfFile = byteCount == 0;
+
+                        if (header.empty()) {
+                            size_t headerEnd = block.bytes.find('\n');
+                            if (headerEnd == string::npos && !endOfFile) {
+                                carry = block.bytes;
+                                continue;
+                            }
+                            header = block.bytes.substr(0, headerEnd == string::npos ? block.bytes.size() : headerEnd + 1);
+                            if (header.empty()) { // an empty file, reported as read_header does
+                                io::error::header_missing err;
+                                err.set_file_name(path.string().c_str());
+                                throw err;
+                            }
+                            if (header.back() != '\n') {
+                                header += '\n';
+                            }
+                        }
+                        size_t lastNewline = block.bytes.rfind('\n');
+                        if (!endOfFile) {
+                            if (lastNewline == string::npos || lastNewline < header.size()) {
+                                carry = block.bytes.substr(header.size());
+                                continue; // a line longer than the block, read on
+                            }
+                            carry = block.bytes.substr(lastNewline + 1);
+                            block.bytes.resize(lastNewline + 1);
+                        }
+                        if (block.bytes.size() == header.size()) {
+                            continue;
+                        }
+                        line += static_cast<unsigned>(count(block.bytes.begin() + header.size(), block.bytes.end(), '\n'));
+                        ++readStats.items;
+                        busySince(start, readStats);
+                        blocks.push(move(block), readStats);
+                        start = chrono::steady_clock::now();
+                    }
+                }
+                catch (const std::exception& e) {
+                    cerr << "Error parsing file " << path << ": " << e.what() << "\n";
+                }
+                busySince(start, readStats);
+            }
+            if (--activeReaders == 0) {
+                blocks.close();
+            }
+            });
+    }
+
+    for (unsigned t = 0; t < threads.parse; ++t) {
+        workers.emplace_back([&] {
+            InputBlock block;
+            while (blocks.pop(block, parseStats)) {
+                auto start = chrono::steady_clock::now();
+                ++parseStats.items;
+                try {
+                    TrendingReader in(block.fileName, block.bytes.data(), block.bytes.data() + block.bytes.size(),
+                        io::ReadPools{ nullptr, &parseBuffers });
+                    readTrendingHeader(in);
+                    in.set_file_line(block.firstLine - 1);
+                    bool more = true;
+                    while (more) {
+                        VideoBatch batch;
+                        batch.country = block.country;
+                        try {
+                            TRACE_SCOPE("pipeline parse batch");
+                            more = readTrendingRows(in, batch) && batch.size == VideoBatch::capacity;
+                        }
+                        catch (const std::exception& e) {
+                            TRACE_COUNT("rows rejected", 1);
+                            cerr << "Error parsing a line in file " << fs::path(block.fileName) << ": " << e.what() << "\n";
+                            more = false;
+                        }
+                        if (query.hasDateWindow()) {
+                            batch.keepRows([&](const string& date) { return query.wantsDate(parseDate(date)); });
+                        }
+                        if (batch.size != 0) {
+                            parseStats.units += batch.size;
+                            busySince(start, parseStats);
+                            batches.push(move(batch), parseStats);
+                            start = chrono::steady_clock::now();
+                        }
+                    }
+                }
+                catch (const std::exception& e) {
+                    cerr << "Error parsing a line in file " << fs::path(block.fileName) << ": " << e.what() << "\n";
+                }
+                busySince(start, parseStats);
+            }
+            if (--activeParsers == 0) {
+                batches.close();
+            }
+            });
+    }
+
+    for (unsigned t = 0; t < threads.aggregate; ++t) {
+        workers.emplace_back([&, t] {
+            VideoBatch batch;
+            while (batches.pop(batch, aggregateStats)) {
+                TRACE_SCOPE("pipeline aggregate batch");
+                auto start = chrono::steady_clock::now();
+                aggregateBatch(batch, partials[t], columnar, tagStats != nullptr);
+                ++aggregateStats.items;
+                aggregateStats.units += batch.size;
+                busySince(start, aggregateStats);
+            }
+            });
+    }
+
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    TRACE_COUNT("parse block buffers", parseBuffers.allocated_count());
+
+    mergeTagAggregates(partials, dataStructure, videos, countryTagViewsRoot, countryTagInteractionsRoot, treeArena, tagStats);
+
+    auto printStage = [](const char* name, unsigned threadCount, const StageStats& stats, const char* unit, double unitScale) {
+        double busySeconds = stats.busyNanos / 1e9;
+        cout << "  " << name << ": " << threadCount << " threads, " << stats.items << " items, "
+            << static_cast<long long>(stats.units / unitScale) << " " << unit << ", busy " << static_cast<long long>(busySeconds * 1000)
+            << " ms, waiting " << stats.waitNanos / 1000000 << " ms";
+        if (busySeconds > 0) {
+            cout << ", " << static_cast<long long>(stats.units / unitScale / busySeconds) << " " << unit << "/s per busy second";
+        }
+        cout << "\n";
+    };
+    cout << "Pipeline stages (the one busy for the longest time per thread is the bottleneck):" << "\n";
+    printStage("read", threads.read, readStats, "MB", 1e6);
+    printStage("parse", threads.parse, parseStats, "rows", 1);
+    printStage("aggregate", threads.aggregate, aggregateStats, "rows", 1);
+}
+
+#if CSV_IO_HAS_COROUTINES
+////////////////////////////////////////////////////////////////////////////
+//                             Coroutine ingest                           //
+////////////////////////////////////////////////////////////////////////////
+
+//the batches of a trending file; with onlyReady they end, setting atEnd only at the end of the
+//file, before a row that would wait for the file to be read. A parse error is thrown after the
+//batch with the rows before the bad one
+io::generator<VideoBatch&> trendingBatches(TrendingReader& in, string country, bool onlyReady, bool& atEnd) {
+    atEnd = false;
+    return io::row_batches<VideoBatch>(in, [country, onlyReady, &atEnd, error = exception_ptr()](TrendingReader& in, VideoBatch& batch) mutable {
+        if (error) {
+            rethrow_exception(error);
+        }
+        batch.country = country;
+        try {
+            atEnd = !readTrendingRows(in, batch, onlyReady);
+        }
+        catch (const std::exception&) {
+            if (batch.size == 0) {
+                throw;
+            }
+            error = current_exception();
+        }
+        return !atEnd && batch.size != 0;
+        });
+}
+
+//the rows of the batches trending in the date window of the query, as a stage chained after
+//trendingBatches
+io::generator<VideoBatch&> inDateWindow(io::generator<VideoBatch&> batches, const IngestQuery& query) {
+    for (VideoBatch& batch : batches) {
+        if (query.hasDateWindow()) {
+            batch.keepRows([&](const string& date) { return query.wantsDate(parseDate(date)); });
+        }
+        if (batch.size != 0) {
+            co_yield batch;
+        }
+    }
+}
+
+//a coroutine that starts when it is scheduled and frees itself when it ends
+struct ScheduledTask {
+    struct promise_type {
+        ScheduledTask get_return_object() { return { coroutine_handle<promise_type>::from_promise(*this) }; }
+        suspend_always initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+
+    coroutine_handle<promise_type> handle;
+};
+
+//resumes coroutines on a fixed number of threads. A coroutine waiting for a read is handed back
+//by the I/O thread that completes it, so the threads only ever parse and aggregate
+class CoroutineScheduler {
+public:
+    void schedule(coroutine_handle<> coroutine) {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            ready.push_back(coroutine);
+        }
+        wakeUp.notify_one();
+    }
+
+    //lets run return once nothing is left to resume
+    void finish() {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            finished = true;
+        }
+        wakeUp.notify_all();
+    }
+
+    //resumes the scheduled coroutines on threadCount threads until finish is called
+    void run(unsigned threadCount) {
+        vector<thread> workers;
+        for (unsigned t = 0; t < threadCount; ++t) {
+            workers.emplace_back([this, t] {
+                currentThread = t;
+                for (;;) {
+                    coroutine_handle<> coroutine;
+                    {
+                        unique_lock<mutex> lock(queueMutex);
+                        wakeUp.wait(lock, [&] { return finished || !ready.empty(); });
+                        if (ready.empty()) {
+                            return;
+                        }
+                        coroutine = ready.front();
+                        ready.pop_front();
+                    }
+                    coroutine.resume();
+                }
+                });
+        }
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    //the scheduler thread the caller runs on
+    static unsigned threadIndex() { return currentThread; }
+
+private:
+    mutex queueMutex;
+    condition_variable wakeUp;
+    deque<coroutine_handle<>> ready;
+    bool finished = false;
+    static inline thread_local unsigned currentThread = 0;
+};
+
+struct CoroutineIngest {
+    const IngestQuery& query;
+    InputMode inputMode;
+    io::ReadPools pools;
+    CoroutineScheduler& scheduler;
+    vector<TagAggregates>& partials; // one per scheduler thread
+    ColumnarVideoExport* columnar;
+    bool keepTagStats;
+};
+
+//ingests one file into the aggregates of the thread it runs on, suspending whenever its next
+//rows are still being read, then calls done
+ScheduledTask ingestFileTask(fs::path path, CoroutineIngest& ingest, function<void()> done) {
+    {
+        TRACE_SCOPE("coroutine open file");
+        try {
+            TrendingReader in(path.string(), openQueryByteSource(path, ingest.inputMode, ingest.query), ingest.pools);
+            readTrendingHeader(in);
+            auto schedule = [&ingest](coroutine_handle<> coroutine) { ingest.scheduler.schedule(coroutine); };
+            try {
+                for (bool atEnd = false; !atEnd;) {
+                    co_await io::row_ready(in, schedule);
+                    for (VideoBatch& batch : inDateWindow(trendingBatches(in, fileCountry(path), true, atEnd), ingest.query)) {
+                        TRACE_SCOPE("coroutine aggregate batch");
+                        aggregateBatch(batch, ingest.partials[CoroutineScheduler::threadIndex()], ingest.columnar, ingest.keepTagStats);
+                    }
+                }
+            }
+            catch (const std::exception& e) {
+                TRACE_COUNT("rows rejected", 1);
+                cerr << "Error parsing a line in file " << path << ": " << e.what() << "\n";
+            }
+        }
+        catch (const std::exception& e) {
+            cerr << "Error parsing file " << path << ": " << e.what() << "\n";
+        }
+    }
+    done();
+}
+
+//ingests the part of the archive the query wants with one coroutine per file, interleaved on
+//threadCount threads: a file whose next block is not read yet gives its thread to another one
+//instead of blocking it. Reads run on one shared I/O thread; at most two files per thread are
+//open at once, so the block buffers stay bounded however many files there are
+void runCoroutineIngest(const string& foldername, InputMode inputMode, const IngestQuery& query, unsigned threadCount,
+    const string& dataStructure, vector<Video>& videos, TreeNode*& countryTagViewsRoot, TreeNode*& countryTagInteractionsRoot,
+    pmr::memory_resource& treeArena, ColumnarVideoExport* columnar, TagStatsTables* tagStats) {
+    vector<fs::path> files;
+    for (const auto& entry : fs::directory_iterator(foldername)) {
+        if (isCsvFile(entry.path()) && query.wantsFile(entry.path())) {
+            files.push_back(entry.path());
+        }
+        else if (isCsvFile(entry.path())) {
+            TRACE_COUNT("files skipped", 1);
+        }
+    }
+    if (files.empty()) {
+        return;
+    }
+
+    size_t openLimit = min<size_t>(files.size(), 2 * threadCount);
+    io::IOThreadPool ioThreads(1);
+    io::BlockBufferPool blockBuffers(static_cast<unsigned>(2 * openLimit));
+    CoroutineScheduler scheduler;
+    vector<TagAggregates> partials(threadCount);
+    CoroutineIngest ingest{ query, inputMode, io::ReadPools{ &ioThreads, &blockBuffers }, scheduler, partials, columnar, tagStats != nullptr };
+
+    atomic<size_t> nextFile{ 0 };
+    atomic<size_t> filesLeft{ files.size() };
+    function<void()> startNext = [&] {
+        size_t file = nextFile++;
+        if (file < files.size()) {
+            scheduler.schedule(ingestFileTask(files[file], ingest, [&] {
+                startNext();
+                if (--filesLeft == 0) {
+                    scheduler.finish();
+                }
+                }).handle);
+        }
+    };
+    for (size_t i = 0; i < openLimit; ++i) {
+        startNext();
+    }
+    scheduler.run(threadCount);
+    TRACE_COUNT("coroutine block buffers", blockBuffers.allocated_count());
+
+    mergeTagAggregates(partials, dataStructure, videos, countryTagViewsRoot, countryTagInteractionsRoot, treeArena, tagStats);
+}
+#endif
+
+#ifndef PROJECT17_NO_INSTRUMENTATION
+//prints the calls and the time of every timed scope and the value of every counter, summed
+//over all threads and over the sites that share a name
+void printTraceSummary(ostream& out) {
+    struct Total {
+        bool timed = false;
+        uint64_t calls = 0;
+        uint64_t total = 0;
+    };
+    map<string, Total> totals;
+    {
+        lock_guard<mutex> lock(traceRegistry.mutex);
+        for (const TraceSite* site : traceRegistry.sites) {
+            Total& total = totals[site->name];
+            total.timed = site->timed;
+            for (const ThreadTrace& trace : traceRegistry.threads) {
+                total.calls += trace.calls[site->id].load(memory_order_relaxed);
+                total.total += trace.totals[site->id].load(memory_order_relaxed);
+            }
+        }
+    }
+
+    vector<pair<string, Total>> timers;
+    vector<pair<string, Total>> counters;
+    for (const auto& entry : totals) {
+        (entry.second.timed ? timers : counters).push_back(entry);
+    }
+    sort(timers.begin(), timers.end(), [](const auto& a, const auto& b) { return a.second.total > b.second.total; });
+
+    out << "Instrumentation summary (nested scopes are included in their parents):" << "\n";
+    out << "  " << left << setw(28) << "scope" << right << setw(12) << "calls" << setw(12) << "total ms" << setw(12) << "mean us" << "\n";
+    for (const auto& timer : timers) {
+        double totalMillis = timer.second.total / 1e6;
+        double meanMicros = timer.second.calls ? timer.second.total / 1e3 / timer.second.calls : 0;
+        out << "  " << left << setw(28) << timer.first << right << setw(12) << timer.second.calls
+            << fixed << setprecision(1) << setw(12) << totalMillis << setprecision(3) << setw(12) << meanMicros << "\n";
+    }
+    out << defaultfloat << setprecision(6);
+    out << "  " << left << setw(28) << "counter" << right << setw(12) << "value" << "\n";
+    for (const auto& counter : counters) {
+        out << "  " << left << setw(28) << counter.first << right << setw(12) << counter.second.total << "\n";
+    }
+    out << left;
+}
+
+//writes the timed scopes that took at least traceEventMinNanos as complete events of a Chrome
+//trace, the counters as counter events at its end and the samples as counter events at their time
+bool writeChromeTrace(const string& path) {
+    ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    lock_guard<mutex> lock(traceRegistry.mutex);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    out << fixed << setprecision(3);
+    bool first = true;
+    auto separate = [&] {
+        if (!first) {
+            out << ",\n";
+        }
+        first = false;
+    };
+    int64_t endNanos = traceNanos();
+    for (ThreadTrace& trace : traceRegistry.threads) {
+        separate();
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << trace.id
+            << ",\"args\":{\"name\":\"" << (trace.id == 1 ? "main" : "thread " + to_string(trace.id)) << "\"}}";
+        lock_guard<mutex> eventsLock(trace.eventsMutex);
+        for (const TraceEvent& event : trace.events) {
+            separate();
+            out << "{\"name\":\"" << traceRegistry.sites[event.site]->name << "\",\"cat\":\"project17\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                << trace.id << ",\"ts\":" << event.beginNanos / 1e3 << ",\"dur\":" << event.durationNanos / 1e3 << "}";
+        }
+    }
+    map<string, uint64_t> counters;
+    for (const TraceSite* site : traceRegistry.sites) {
+        if (!site->timed) {
+            for (const ThreadTrace& trace : traceRegistry.threads) {
+                counters[site->name] += trace.totals[site->id].load(memory_order_relaxed);
+            }
+        }
+    }
+    for (const auto& counter : counters) {
+        separate();
+        out << "{\"name\":\"" << counter.first << "\",\"ph\":\"C\",\"pid\":1,\"ts\":" << endNanos / 1e3
+            << ",\"args\":{\"value\":" << counter.second << "}}";
+    }
+    for (const TraceSample& sample : traceRegistry.samples) {
+        separate();
+        out << "{\"name\":\"" << sample.name << "\",\"ph\":\"C\",\"pid\":1,\"ts\":" << sample.nanos / 1e3 << ",\"args\":{";
+        for (size_t i = 0; i < sample.values.size(); ++i) {
+            out << (i ? "," : "") << "\"" << sample.values[i].first << "\":" << sample.values[i].second;
+        }
+        out << "}}";
+    }
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+//                            Memory accounting                           //
+////////////////////////////////////////////////////////////////////////////
+
+//objects and heap bytes held by one structure
+struct MemoryUsage {
+    string structure;
+    size_t objects;
+    size_t bytes;
+};
+
+//resident set size of the process now and at its highest so far, 0 where it can not be read
+struct ProcessMemory {
+    size_t residentBytes = 0;
+    size_t peakResidentBytes = 0;
+};
+
+ProcessMemory processMemory() {
+    ProcessMemory memory;
+#if defined(__linux__)
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) {
+            memory.residentBytes = stoull(line.substr(6)) * 1024;
+        }
+        else if (line.compare(0, 6, "VmHWM:") == 0) {
+            memory.peakResidentBytes = stoull(line.substr(6)) * 1024;
+        }
+    }
+#endif
+#ifndef _WIN32
+    if (memory.peakResidentBytes == 0) {
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+            memory.peakResidentBytes = usage.ru_maxrss; // bytes on macOS, kilobytes elsewhere
+#else
+            memory.peakResidentBytes = static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+        }
+    }
+#endif
+    return memory;
+}
+
+//heap bytes of a string, 0 if it fits in the string object itself
+size_t stringHeapBytes(const string& s) {
+    return s.capacity() > string().capacity() ? s.capacity() + 1 : 0;
+}
+
+MemoryUsage videosMemory(const vector<Video>& videos) {
+    size_t bytes = videos.capacity() * sizeof(Video);
+    for (const Video& video : videos) {
+        for (const string* field : { &video.video_id, &video.country, &video.trending_date, &video.title, &video.channel_title,
+            &video.publish_time, &video.tags, &video.temp_comments_disabled, &video.temp_ratings_disabled,
+            &video.temp_video_error_or_removed, &video.thumbnail_link, &video.description }) {
+            bytes += stringHeapBytes(*field);
+        }
+    }
+    return { "videos", videos.size(), bytes };
+}
+
+//a std::map node holds the value after three pointers and the colour
+const size_t mapNodeOverhead = 4 * sizeof(void*);
+
+MemoryUsage tagTablesMemory(const string& structure, const map<string, TagTable>& tables) {
+    MemoryUsage usage{ structure, 0, 0 };
+    for (const auto& country : tables) {
+        usage.objects += country.second.size();
+        usage.bytes += country.second.memoryBytes() + sizeof(country) + mapNodeOverhead + stringHeapBytes(country.first);
+    }
+    return usage;
+}
+
+MemoryUsage tagTablesMemory(const string& structure, const vector<const TagTable*>& tables) {
+    MemoryUsage usage{ structure, 0, 0 };
+    for (const TagTable* table : tables) {
+        usage.objects += table->size();
+        usage.bytes += table->memoryBytes();
+    }
+    return usage;
+}
+
+//the tags too long for small string storage, already counted in the bytes of their tables
+MemoryUsage tagStringsMemory(const vector<const TagTable*>& tables) {
+    MemoryUsage usage{ "  of which long tag strings", 0, 0 };
+    for (const TagTable* table : tables) {
+        pair<size_t, size_t> strings = table->longTagStrings();
+        usage.objects += strings.first;
+        usage.bytes += strings.second;
+    }
+    return usage;
+}
+
+MemoryUsage tagStatsMemory(const TagStatsTables* stats) {
+    MemoryUsage usage{ "per-tag statistics", 0, 0 };
+    if (stats == nullptr) {
+        return usage;
+    }
+    vector<const TagStatsTable*> tables;
+    for (const auto& country : stats->countries) {
+        tables.push_back(&country.second);
+    }
+    for (const TagStatsTable* table : tables) {
+        usage.objects += table->size();
+        for (const auto& entry : *table) {
+            usage.bytes += sizeof(entry) + mapNodeOverhead + stringHeapBytes(entry.first) + entry.second.views.memoryBytes();
+        }
+    }
+    return usage;
+}
+
+MemoryUsage cooccurrenceMemory(const map<string, TagCooccurrence>& matrices) {
+    MemoryUsage usage{ "co-occurrence matrices", 0, 0 };
+    for (const auto& matrix : matrices) {
+        const TagCooccurrence& m = matrix.second;
+        usage.objects += m.neighbours.size();
+        usage.bytes += m.rowBegin.capacity() * sizeof(size_t) + m.neighbours.capacity() * sizeof(m.neighbours[0]);
+        for (int id = 0; id < static_cast<int>(m.tags.size()); ++id) {
+            // the name, the deque slot and the hash map entry of every tag
+            usage.bytes += stringHeapBytes(m.tags.name(id)) + sizeof(string) + sizeof(pair<string_view, int>) + 2 * sizeof(void*);
+        }
+    }
+    return usage;
+}
+
+//samples the resident memory after a phase, for the memory report and, with --trace, the trace
+void recordMemoryPhase(vector<pair<string, ProcessMemory>>& phases, const string& phase) {
+    phases.emplace_back(phase, processMemory());
+    TRACE_SAMPLE("resident memory", { "MB now", phases.back().second.residentBytes / (1024.0 * 1024.0) },
+        { "MB peak", phases.back().second.peakResidentBytes / (1024.0 * 1024.0) });
+}
+
+void printMemoryReport(const vector<MemoryUsage>& structures, const vector<pair<string, ProcessMemory>>& phases) {
+    auto megabytes = [](size_t bytes) { return bytes / (1024.0 * 1024.0); };
+#ifndef PROJECT17_NO_INSTRUMENTATION
+    vector<pair<string, double>> kilobytes;
+    for (const MemoryUsage& usage : structures) {
+        kilobytes.emplace_back(usage.structure.substr(usage.structure.find_first_not_of(' ')), usage.bytes / 1024.0);
+    }
+    sampleTrace("KB by structure", move(kilobytes));
+#endif
+    cout << "\nMemory by structure:" << "\n";
+    cout << "  " << left << setw(32) << "structure" << right << setw(12) << "objects" << setw(12) << "KB" << "\n";
+    for (const MemoryUsage& usage : structures) {
+        cout << "  " << left << setw(32) << usage.structure << right << setw(12) << usage.objects
+            << setw(12) << (usage.bytes + 1023) / 1024 << "\n";
+    }
+    cout << "Resident memory by phase:" << "\n";
+    cout << "  " << left << setw(32) << "after" << right << setw(12) << "MB now" << setw(12) << "MB peak" << "\n";
+    for (const auto& phase : phases) {
+        cout << "  " << left << setw(32) << phase.first << right << fixed << setprecision(1) << setw(12) << megabytes(phase.second.residentBytes)
+            << setw(12) << megabytes(phase.second.peakResidentBytes) << "\n";
+    }
+    cout << left << defaultfloat << setprecision(6);
+}
+
+//options given on the command line, everything else is asked interactively
+struct Options {
+    size_t cooccurrenceTopM = 0; // 0 = do not build the co-occurrence matrix
+    bool tagSearch = false;
+    string servePath; // empty = interactive report instead of the query server
+    InputMode inputMode = InputMode::stdio;
+    bool pipeline = false;
+    PipelineThreads pipelineThreads;
+    bool trace = false;
+    string tracePath; // empty = only print the summary
+    string exportPath; // empty = no export of the full rankings
+    ExportFormat exportFormat = ExportFormat::csv;
+    string columnarPath; // empty = no columnar export
+    unsigned shardIndex = 0;
+    unsigned shardCount = 0; // 0 = ingest the whole archive
+    bool shardByVideo = false; // split the rows by video id instead of the files by country
+    string partialPath; // partial aggregate file a shard or a merge writes
+    bool merge = false;
+    vector<string> mergeInputs;
+    size_t memoryBudget = 0; // bytes the tag tables may hold before they are spilled, 0 = no limit
+    string spillPath; // empty = the system temporary directory
+    string tagStatsMetric; // mean, p50, p90 or p99; empty = no per-tag statistics
+    size_t tagStatsMinVideos = 5;
+    int firstDate = 0; // yyyymmdd of the first trending day ingested
+    int lastDate = INT_MAX;
+    bool dateIndex = false;
+    string dateIndexPath; // empty = next to the files
+    unsigned coroutineThreads = 0; // 0 = no coroutine ingest
+};
+
+void printUsage(const char* program) {
+    cerr << "Usage: " << program << " [options]\n"
+        << "  --cooccurrence[=M]  build the tag co-occurrence matrix over the top M tags of each country (default 1000)\n"
+        << "  --search            build the tag search index and ask for prefix/substring queries after the report\n"
+        << "  --serve=SOCKET      keep the aggregates in memory and answer queries on a Unix socket\n"
+        << "  --io=MODE           read files with stdio (default), uring or uring-direct (Linux only)\n"
+        << "  --pipeline[=R,P,A]  ingest with R read, P parse and A aggregate threads (default 1,rest,1)\n"
+        << "  --score=FORMULA     engagement score: default, likes, comments, approval, or weights L,D,C of\n"
+        << "                      likes, dislikes and comments per view (default 1,0.5,1.5)\n"
+        << "  --trace[=FILE]      print counters and time per instrumented scope at the end, and write\n"
+        << "                      the slow scopes to FILE as a Chrome trace (chrome://tracing, ui.perfetto.dev)\n"
+        << "  --export=DIR        write the full views and interaction rankings of each selected country\n"
+        << "                      and of all of them together to files in DIR\n"
+        << "  --format=FORMAT     format of the exported rankings: csv (default) or jsonl\n"
+        << "  --columnar=DIR      write the parsed videos and the tag aggregates to DIR as column chunks\n"
+        << "                      (videos.p17c, tags.p17c; the format is described in the source)\n"
+        << "  --shard=I/N[:MODE]  ingest only shard I of 0..N-1 and write its tag aggregates to a partial\n"
+        << "                      file instead of reporting; MODE country (default) splits the files by\n"
+        << "                      country, video splits the rows by video id\n"
+        << "  --partial=FILE      partial file to write (default partial-I-of-N.p17a for a shard)\n"
+        << "  --merge FILE...     merge partial files into the final rankings, printed and written with\n"
+        << "                      --export; with --partial the merged aggregates are written as a partial too\n"
+        << "  --memory-budget=MB  keep the tag tables of the map report under MB, spilling sorted runs to\n"
+        << "                      disk and merging them for the report; the videos are not kept in memory\n"
+        << "  --spill-dir=DIR     where --memory-budget spills its runs (default the temporary directory)\n"
+        << "  --tag-stats[=M[,N]] keep count, mean, deviation and p50/p90/p99 of the views of every tag and\n"
+        << "                      rank the tags of at least N videos (default 5) by M: mean, p50 (default),\n"
+        << "                      p90 or p99; --export also writes the statistics of every tag. With --shard\n"
+        << "                      they are written to the partial file, and --merge merges and ranks them\n"
+        << "  --from=DATE         ingest only the rows trending on DATE (yy.dd.mm or yyyy-mm-dd) or later\n"
+        << "  --to=DATE           ingest only the rows trending on DATE or earlier\n"
+        << "  --date-index[=DIR]  keep an index of the rows of each CSV file by trending date in DIR (default\n"
+        << "                      next to the files), so --from and --to read only the rows in their window\n"
+        << "  --coroutines[=T]    ingest every file in a coroutine, interleaved on T threads (default the\n"
+        << "                      cores), each suspending while its file is read (C++20 builds)\n"
+        << "Only the files of the selected countries are ingested, unless --export, --columnar or --search\n"
+        << "need every country.\n";
+}
+
+Options parseOptions(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        string name = arg.substr(0, arg.find('='));
+        string value = arg.find('=') == string::npos ? "" : arg.substr(arg.find('=') + 1);
+
+        if (name == "--cooccurrence") {
+            options.cooccurrenceTopM = 1000;
+            if (!value.empty() && (!parseNumber(value, options.cooccurrenceTopM) || options.cooccurrenceTopM == 0)) {
+                cerr << "--cooccurrence expects a positive number of tags, e.g. --cooccurrence=1000" << "\n";
+                exit(1);
+            }
+        }
+        else if (name == "--search") {
+            options.tagSearch = true;
+        }
+        else if (name == "--serve" && !value.empty()) {
+            options.servePath = value;
+        }
+        else if (name == "--score" && !value.empty()) {
+            auto named = find_if(begin(namedEngagementWeights), end(namedEngagementWeights),
+                [&](const auto& formula) { return value == formula.first; });
+            vector<string> weights = split(value, ',');
+            EngagementWeights parsed;
+            if (named != end(namedEngagementWeights)) {
+                engagementWeights = named->second;
+            }
+            else if (weights.size() == 3 && parseNumber(weights[0], parsed.like) && parseNumber(weights[1], parsed.dislike)
+                && parseNumber(weights[2], parsed.comment) && isfinite(parsed.like) && isfinite(parsed.dislike) && isfinite(parsed.comment)) {
+                engagementWeights = parsed;
+            }
+            else {
+                cerr << "--score expects default, likes, comments, approval or three weights, e.g. --score=1,0.5,1.5" << "\n";
+                exit(1);
+            }
+        }
+        else if (name == "--trace") {
+            options.trace = true;
+            options.tracePath = value;
+#ifndef PROJECT17_NO_INSTRUMENTATION
+            traceRegistry.start = chrono::steady_clock::now();
+            traceRegistry.enabled = true;
+#else
+            cerr << "--trace has no effect, the instrumentation was compiled out (PROJECT17_NO_INSTRUMENTATION)" << "\n";
+#endif
+        }
+        else if (name == "--export" && !value.empty()) {
+            options.exportPath = value;
+        }
+        else if (name == "--columnar" && !value.empty()) {
+            options.columnarPath = value;
+        }
+        else if (name == "--format" && (value == "csv" || value == "jsonl")) {
+            options.exportFormat = value == "csv" ? ExportFormat::csv : ExportFormat::jsonl;
+        }
+        else if (name == "--shard" && !value.empty()) {
+            size_t slash = value.find('/');
+            size_t colon = value.find(':');
+            string mode = colon == string::npos ? "country" : value.substr(colon + 1);
+            if (slash == string::npos || (colon != string::npos && colon < slash) || (mode != "country" && mode != "video")
+                || !parseNumber(string_view(value).substr(0, slash), options.shardIndex)
+                || !parseNumber(string_view(value).substr(slash + 1, colon - slash - 1), options.shardCount)) {
+                cerr << "--shard expects I/N, I/N:country or I/N:video, e.g. --shard=0/4:video" << "\n";
+                exit(1);
+            }
+            options.shardByVideo = mode == "video";
+            if (options.shardIndex >= options.shardCount) {
+                cerr << "--shard=I/N needs I < N" << "\n";
+                exit(1);
+            }
+        }
+        else if (name == "--partial" && !value.empty()) {
+            options.partialPath = value;
+        }
+        else if (arg == "--merge") {
+            options.merge = true;
+        }
+        else if (arg.rfind("--", 0) != 0 && options.merge) {
+            options.mergeInputs.push_back(arg);
+        }
+        else if (name == "--memory-budget" && !value.empty()) {
+            double megabytes = 0;
+            if (!parseNumber(value, megabytes) || !(megabytes > 0) || megabytes * 1024 * 1024 > static_cast<double>(SIZE_MAX / 2)) {
+                cerr << "--memory-budget expects a positive number of megabytes, e.g. --memory-budget=256" << "\n";
+                exit(1);
+            }
+            options.memoryBudget = max<size_t>(1, static_cast<size_t>(megabytes * 1024 * 1024));
+        }
+        else if (name == "--spill-dir" && !value.empty()) {
+            options.spillPath = value;
+        }
+        else if (name == "--tag-stats") {
+            vector<string> parts = split(value.empty() ? "p50" : value, ',');
+            if (parts.empty() || parts.size() > 2 || (parts[0] != "mean" && parts[0] != "p50" && parts[0] != "p90" && parts[0] != "p99")
+                || (parts.size() == 2 && !parseNumber(parts[1], options.tagStatsMinVideos))) {
+                cerr << "--tag-stats expects mean, p50, p90 or p99 and optionally the least videos of a tag, e.g. --tag-stats=p90,10" << "\n";
+                exit(1);
+            }
+            options.tagStatsMetric = parts[0];
+        }
+        else if ((name == "--from" || name == "--to") && !value.empty()) {
+            int date = parseDate(value);
+            if (date < 0) {
+                cerr << name << " expects a date as yy.dd.mm or yyyy-mm-dd, e.g. " << name << "=2018-01-31" << "\n";
+                exit(1);
+            }
+            (name == "--from" ? options.firstDate : options.lastDate) = date;
+        }
+        else if (name == "--coroutines") {
+#if CSV_IO_HAS_COROUTINES
+            options.coroutineThreads = max(1u, thread::hardware_concurrency());
+            if (!value.empty() && (!parseNumber(value, options.coroutineThreads) || options.coroutineThreads == 0)) {
+                cerr << "--coroutines expects a positive number of threads, e.g. --coroutines=4" << "\n";
+                exit(1);
+            }
+#else
+            cerr << "--coroutines needs a build with C++20 coroutines" << "\n";
+            exit(1);
+#endif
+        }
+        else if (name == "--date-index") {
+            options.dateIndex = true;
+            options.dateIndexPath = value;
+            error_code error;
+            if (!value.empty() && !fs::create_directories(value, error) && error) {
+                cerr << "Can not create the date index directory " << value << ": " << error.message() << "\n";
+                exit(1);
+            }
+        }
+        else if (name == "--pipeline") {
+            options.pipeline = true;
+            if (!value.empty()) {
+                vector<string> counts = split(value, ',');
+                PipelineThreads& threads = options.pipelineThreads;
+                if (counts.size() != 3 || !parseNumber(counts[0], threads.read) || !parseNumber(counts[1], threads.parse)
+                    || !parseNumber(counts[2], threads.aggregate)) {
+                    cerr << "--pipeline expects three thread counts, e.g. --pipeline=1,6,1" << "\n";
+                    exit(1);
+                }
+                threads.read = max(1u, threads.read);
+                threads.aggregate = max(1u, threads.aggregate);
+            }
+        }
+#if defined(__linux__)
+        else if (name == "--io" && (value == "stdio" || value == "uring" || value == "uring-direct")) {
+            options.inputMode = value == "stdio" ? InputMode::stdio : value == "uring" ? InputMode::uring : InputMode::uringDirect;
+        }
+#endif
+        else {
+            cerr << "Unknown option: " << arg << "\n";
+            printUsage(argv[0]);
+            exit(1);
+        }
+    }
+    if (options.memoryBudget > 0 && (options.cooccurrenceTopM > 0 || options.tagSearch || !options.exportPath.empty()
+        || !options.columnarPath.empty() || !options.tagStatsMetric.empty())) {
+        cerr << "--memory-budget keeps neither the videos nor the full tag tables, it can not be combined with "
+            << "--cooccurrence, --search, --export, --columnar or --tag-stats" << "\n";
+        exit(1);
+    }
+    return options;
+}
+
+//prints the instrumentation summary and writes the Chrome trace if --trace asked for them
+void reportTrace(const Options& options) {
+#ifndef PROJECT17_NO_INSTRUMENTATION
+    if (!options.trace) {
+        return;
+    }
+    printTraceSummary(cout);
+    if (!options.tracePath.empty()) {
+        if (writeChromeTrace(options.tracePath)) {
+            cout << "Chrome trace written to " << options.tracePath << "\n";
+        }
+        else {
+            cerr << "Could not write the trace to " << options.tracePath << "\n";
+        }
+    }
+#else
+    (void)options;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////
+//                  Sharded ingest and spilling aggregation               //
+////////////////////////////////////////////////////////////////////////////
+
+// A partial aggregate file (.p17a) holds the tag views and interaction of one shard, sorted by
+// country and then by tag in byte order, so any number of them merge in a single pass. A tag
+// is stored as the length of the prefix it shares with the tag before it plus the rest. All
+// integers are LEB128 varints, the values zigzag encoded. The totals over every country are
+// stored as the country "all". A shard ingested with --tag-stats follows each tag with the
+// statistics of its views (TagStats), the quantile sketch stored level by level so it merges
+// like the in-memory ones. Version 1 files have no statistics and are still read.
+//
+//   file   = "P17A" u8 version(2) record* u8 0
+//   record = u8 1 u8 countryLength country                 the tags of a country follow
+//          | u8 2 varint shared varint suffixLength suffix zigzag views zigzag interaction
+//          | u8 3 varint count f64 mean f64 m2 sketch       statistics of the tag before
+//   sketch = varint k varint coin varint n varint levelCount (varint itemCount zigzag item*)*
+// f64 is an IEEE double stored as 8 little-endian bytes.
+
+//writes a partial aggregate file; countries, and the tags of a country, have to come in
+//increasing order. Throws runtime_error if the file can not be written
+class PartialAggregateWriter {
+public:
+    explicit PartialAggregateWriter(const fs::path& path)
+        : path(path), file(fopen(path.string().c_str(), "wb"), fclose), out(file.get()) {
+        if (!file) {
+            throw runtime_error("can not create " + path.string() + ": " + strerror(errno));
+        }
+        setvbuf(file.get(), nullptr, _IONBF, 0); // the writer's buffer is the only one
+        out << "P17A" << '\2';
+    }
+
+    void beginCountry(string_view country) {
+        if (country.empty() || country.size() > 255 || (started && country <= currentCountry)) {
+            throw logic_error("countries of a partial aggregate file must be increasing and 1 to 255 bytes long");
+        }
+        out << '\1' << static_cast<char>(country.size()) << country;
+        currentCountry = country;
+        previousTag.clear();
+        started = true;
+        firstTag = true;
+    }
+
+    void add(string_view tag, long long views, long long interaction) {
+        if (!started || (!firstTag && tag <= previousTag)) {
+            throw logic_error("tags of a partial aggregate file must be increasing within a country");
+        }
+        size_t shared = 0;
+        while (shared < tag.size() && shared < previousTag.size() && tag[shared] == previousTag[shared]) {
+            ++shared;
+        }
+        out << '\2';
+        putVarint(shared);
+        putVarint(tag.size() - shared);
+        out << tag.substr(shared);
+        putSigned(views);
+        putSigned(interaction);
+        previousTag = tag;
+        firstTag = false;
+        ++tags;
+    }
+
+    //stores the statistics of the tag added last
+    void addStats(const TagStats& stats) {
+        if (firstTag) {
+            throw logic_error("tag statistics of a partial aggregate file must follow their tag");
+        }
+        out << '\3';
+        putVarint(stats.count);
+        putDouble(stats.mean);
+        putDouble(stats.m2);
+        QuantileSketch::State sketch = stats.views.state();
+        putVarint(sketch.k);
+        putVarint(sketch.coin);
+        putVarint(sketch.n);
+        putVarint(sketch.levels.size());
+        for (const vector<int>& level : sketch.levels) {
+            putVarint(level.size());
+            for (int item : level) {
+                putSigned(item);
+            }
+        }
+    }
+
+    void finish() {
+        out << '\0';
+        out.flush();
+        if (out.failed()) {
+            throw runtime_error("can not write " + path.string() + ": " + strerror(errno));
+        }
+    }
+
+    uint64_t tagCount() const { return tags; }
+
+private:
+    void putVarint(uint64_t value) {
+        for (; value >= 0x80; value >>= 7) {
+            out << static_cast<char>(value | 0x80);
+        }
+        out << static_cast<char>(value);
+    }
+
+    void putSigned(long long value) {
+        putVarint((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+    }
+
+    void putDouble(double value) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        for (int i = 0; i < 8; ++i, bits >>= 8) {
+            out << static_cast<char>(bits & 0xFF);
+        }
+    }
+
+    fs::path path;
+    unique_ptr<FILE, int (*)(FILE*)> file;
+    ReportWriter out; // declared after file, so it flushes before the file is closed
+    string currentCountry;
+    string previousTag;
+    bool started = false;
+    bool firstTag = true;
+    uint64_t tags = 0;
+};
+
+//reads a partial aggregate file tag by tag. Throws runtime_error if it is cut short, damaged
+//or not sorted
+class PartialAggregateReader {
+public:
+    explicit PartialAggregateReader(const fs::path& path, size_t bufferSize = 64 * 1024)
+        : path(path), file(fopen(path.string().c_str(), "rb"), fclose), buffer(bufferSize) {
+        if (!file) {
+            throw runtime_error("can not open " + path.string() + ": " + strerror(errno));
+        }
+        char magic[5];
+        for (char& c : magic) {
+            c = static_cast<char>(get());
+        }
+        if (string_view(magic, 4) != "P17A" || (magic[4] != '\1' && magic[4] != '\2')) {
+            fail("not a partial aggregate file of version 1 or 2");
+        }
+    }
+
+    //moves to the next tag, false at the end of the file
+    bool next() {
+        for (;;) {
+            int kind = get();
+            if (kind == 0) {
+                return false;
+            }
+            if (kind == 1) {
+                string country(get(), '\0');
+                for (char& c : country) {
+                    c = static_cast<char>(get());
+                }
+                if (country.empty() || (!currentCountry.empty() && country <= currentCountry)) {
+                    fail("countries are not sorted");
+                }
+                currentCountry = move(country);
+                currentTag.clear();
+                firstTag = true;
+                continue;
+            }
+            if (kind != 2 || currentCountry.empty()) {
+                fail("unexpected record");
+            }
+            uint64_t shared = getVarint();
+            uint64_t suffixLength = getVarint();
+            if (shared > currentTag.size() || suffixLength > (1 << 20)) {
+                fail("damaged tag");
+            }
+            previousTag = currentTag;
+            currentTag.resize(shared);
+            for (uint64_t i = 0; i < suffixLength; ++i) {
+                currentTag += static_cast<char>(get());
+            }
+            if (!firstTag && currentTag <= previousTag) {
+                fail("tags are not sorted");
+            }
+            firstTag = false;
+            currentViews = getSigned();
+            currentInteraction = getSigned();
+            currentHasStats = peek() == 3;
+            if (currentHasStats) {
+                get();
+                readStats();
+            }
+            return true;
+        }
+    }
+
+    const string& country() const { return currentCountry; }
+    const string& tag() const { return currentTag; }
+    long long views() const { return currentViews; }
+    long long interaction() const { return currentInteraction; }
+    //the statistics of the tag, if the file has them
+    const TagStats* stats() const { return currentHasStats ? &currentStats : nullptr; }
+
+private:
+    void readStats() {
+        currentStats.count = getVarint();
+        currentStats.mean = getDouble();
+        currentStats.m2 = getDouble();
+        QuantileSketch::State sketch;
+        uint64_t k = getVarint();
+        if (k == 0 || k > UINT16_MAX) {
+            fail("damaged tag statistics");
+        }
+        sketch.k = static_cast<uint16_t>(k);
+        sketch.coin = getVarint();
+        sketch.n = getVarint();
+        uint64_t levelCount = getVarint();
+        if (levelCount > 64) {
+            fail("damaged tag statistics");
+        }
+        sketch.levels.resize(levelCount);
+        for (vector<int>& level : sketch.levels) {
+            uint64_t itemCount = getVarint();
+            if (itemCount > (1 << 20)) {
+                fail("damaged tag statistics");
+            }
+            level.resize(itemCount);
+            for (int& item : level) {
+                item = static_cast<int>(getSigned());
+            }
+        }
+        currentStats.views = QuantileSketch(move(sketch));
+    }
+
+    int peek() {
+        if (position == length) {
+            length = fread(buffer.data(), 1, buffer.size(), file.get());
+            position = 0;
+            if (length == 0) {
+                fail("cut short");
+            }
+        }
+        return static_cast<unsigned char>(buffer[position]);
+    }
+
+    int get() {
+        int byte = peek();
+        ++position;
+        return byte;
+    }
+
+    double getDouble() {
+        uint64_t bits = 0;
+        for (int i = 0; i < 8; ++i) {
+            bits |= static_cast<uint64_t>(get()) << (8 * i);
+        }
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    uint64_t getVarint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int byte = get();
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (byte < 0x80) {
+                return value;
+            }
+        }
+        fail("damaged number");
+        return 0;
+    }
+
+    long long getSigned() {
+        uint64_t value = getVarint();
+        return static_cast<long long>(value >> 1) ^ -static_cast<long long>(value & 1);
+    }
+
+    [[noreturn]] void fail(const string& what) {
+        throw runtime_error(path.string() + ": " + what);
+    }
+
+    fs::path path;
+    unique_ptr<FILE, int (*)(FILE*)> file;
+    vector<char> buffer;
+    size_t position = 0;
+    size_t length = 0;
+    string currentCountry;
+    string currentTag;
+    string previousTag;
+    bool firstTag = true;
+    long long currentViews = 0;
+    long long currentInteraction = 0;
+    bool currentHasStats = false;
+    TagStats currentStats;
+};
+
+//merges partial aggregate files into one sorted stream: f(country, tag, views, interaction) is
+//called once per country and tag, with the sums over the files holding it. Every file is read
+//once, so the merge takes time linear in their size times log of their count. The tag
+//statistics of the files are merged into stats, if given, before f is called for their tag
+template <class F>
+void mergePartialAggregates(const vector<string>& paths, F f, TagStatsTables* stats = nullptr) {
+    vector<unique_ptr<PartialAggregateReader>> readers;
+    for (const string& path : paths) {
+        readers.push_back(make_unique<PartialAggregateReader>(path));
+    }
+    auto after = [&](size_t a, size_t b) {
+        int order = readers[a]->country().compare(readers[b]->country());
+        if (order == 0) {
+            order = readers[a]->tag().compare(readers[b]->tag());
+        }
+        return order != 0 ? order > 0 : a > b;
+    };
+    priority_queue<size_t, vector<size_t>, decltype(after)> heads(after);
+    for (size_t r = 0; r < readers.size(); ++r) {
+        if (readers[r]->next()) {
+            heads.push(r);
+        }
+    }
+    string country, tag;
+    while (!heads.empty()) {
+        size_t r = heads.top();
+        heads.pop();
+        country = readers[r]->country();
+        tag = readers[r]->tag();
+        long long views = readers[r]->views();
+        long long interaction = readers[r]->interaction();
+        TagStats* tagStats = nullptr;
+        auto mergeStats = [&](const PartialAggregateReader& reader) {
+            if (stats && reader.stats()) {
+                if (!tagStats) {
+                    tagStats = &stats->countries[country][tag];
+                }
+                tagStats->merge(*reader.stats());
+            }
+        };
+        mergeStats(*readers[r]);
+        if (readers[r]->next()) {
+            heads.push(r);
+        }
+        while (!heads.empty() && readers[heads.top()]->country() == country && readers[heads.top()]->tag() == tag) {
+            r = heads.top();
+            heads.pop();
+            views += readers[r]->views();
+            interaction += readers[r]->interaction();
+            mergeStats(*readers[r]);
+            if (readers[r]->next()) {
+                heads.push(r);
+            }
+        }
+        f(country, tag, views, interaction);
+    }
+}
+
+//FNV-1a; unlike std::hash it is the same in every process and build, so shards agree on it
+uint64_t stableHash(string_view key) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : key) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+//calls f(tag, views, interaction) in tag order for every tag of the tables, with its sums over
+//the countries. The tables are already in tag order, so this merges them k ways instead of
+//laying them out as CountryTagArrays: it runs when spilling, once the tables hit the budget
+template <class F>
+void forEachSummedTag(const map<string, TagTable>& views, const map<string, TagTable>& interaction, F f) {
+    struct Cursor {
+        TagTable::Map::const_iterator view;
+        TagTable::Map::const_iterator viewEnd;
+        TagTable::Map::const_iterator interaction;
+    };
+    vector<Cursor> cursors;
+    for (const auto& country : views) {
+        const TagTable& countryInteraction = interaction.at(country.first);
+        if (countryInteraction.size() != country.second.size()) {
+            throw logic_error("the views and interaction tables of " + country.first + " hold different tags");
+        }
+        if (country.second.size() != 0) {
+            cursors.push_back({ country.second.begin(), country.second.end(), countryInteraction.begin() });
+        }
+    }
+    auto after = [&](size_t a, size_t b) { return string_view(cursors[a].view->first) > string_view(cursors[b].view->first); };
+    priority_queue<size_t, vector<size_t>, decltype(after)> heads(after);
+    for (size_t c = 0; c < cursors.size(); ++c) {
+        heads.push(c);
+    }
+    while (!heads.empty()) {
+        string_view tag = cursors[heads.top()].view->first;
+        long long tagViews = 0;
+        long long tagInteraction = 0;
+        while (!heads.empty() && string_view(cursors[heads.top()].view->first) == tag) {
+            Cursor& cursor = cursors[heads.top()];
+            heads.pop();
+            tagViews += cursor.view->second;
+            tagInteraction += cursor.interaction->second;
+            ++cursor.interaction;
+            if (++cursor.view != cursor.viewEnd) {
+                heads.push(&cursor - cursors.data());
+            }
+        }
+        f(tag, tagViews, tagInteraction);
+    }
+}
+
+//writes the tag tables to a partial aggregate file, their sums over all countries as the
+//country "all", and returns the number of tags written. The tag statistics go with their tags
+//if the aggregates kept any
+uint64_t writePartialAggregates(const fs::path& path, const TagAggregates& aggregates) {
+    const map<string, TagStatsTable>& stats = aggregates.tagStats.countries;
+    auto countryStats = [&](const string& country, string_view tag) -> const TagStats* {
+        auto table = stats.find(country);
+        if (table == stats.end()) {
+            return nullptr;
+        }
+        auto entry = table->second.find(tag);
+        return entry == table->second.end() ? nullptr : &entry->second;
+    };
+
+    vector<string> countries;
+    for (const auto& country : aggregates.countryTagViews) {
+        countries.push_back(country.first);
+    }
+    countries.push_back("all");
+    sort(countries.begin(), countries.end());
+
+    PartialAggregateWriter writer(path);
+    for (const string& country : countries) {
+        writer.beginCountry(country);
+        if (country == "all") {
+            forEachSummedTag(aggregates.countryTagViews, aggregates.countryTagInteractions, [&](string_view tag, long long views, long long interaction) {
+                writer.add(tag, views, interaction);
+                if (!stats.empty()) {
+                    TagStats all;
+                    for (const auto& table : stats) {
+                        if (const TagStats* tagStats = countryStats(table.first, tag)) {
+                            all.merge(*tagStats);
+                        }
+                    }
+                    writer.addStats(all);
+                }
+                });
+            continue;
+        }
+        const TagTable& interaction = aggregates.countryTagInteractions.at(country);
+        auto i = interaction.begin();
+        for (const auto& entry : aggregates.countryTagViews.at(country)) {
+            writer.add(entry.first, entry.second, (i++)->second);
+            if (const TagStats* tagStats = countryStats(country, entry.first)) {
+                writer.addStats(*tagStats);
+            }
+        }
+    }
+    writer.finish();
+    return writer.tagCount();
+}
+
+bool inShard(string_view key, const Options& options) {
+    return stableHash(key) % options.shardCount == options.shardIndex;
+}
+
+//ingests the shard --shard selects and writes its tag aggregates to a partial aggregate file
+int runShard(const string& foldername, const Options& options) {
+    auto start = chrono::high_resolution_clock::now();
+    TagAggregates aggregates;
+    size_t fileCount = 0;
+    size_t videoCount = 0;
+    {
+        TRACE_SCOPE("ingest");
+        readArchive(foldername, options.inputMode, [&](const fs::path& path) {
+            bool accepted = options.shardByVideo || inShard(path.filename().string().substr(0, 2), options);
+            fileCount += accepted;
+            return accepted;
+            },
+            [&](const Video& video, double engagement) {
+                if (options.shardByVideo && !inShard(video.video_id, options)) {
+                    return;
+                }
+                ++videoCount;
+                updateTagViewsAndInteractions(video, engagement, aggregates.countryTagViews, aggregates.countryTagInteractions);
+                if (!options.tagStatsMetric.empty()) {
+                    updateTagStats(video, aggregates.tagStats);
+                }
+            });
+    }
+
+    string path = options.partialPath.empty()
+        ? "partial-" + to_string(options.shardIndex) + "-of-" + to_string(options.shardCount) + ".p17a" : options.partialPath;
+    uint64_t tagCount = 0;
+    try {
+        tagCount = writePartialAggregates(path, aggregates);
+    }
+    catch (const exception& e) {
+        cerr << "Writing the partial aggregates failed: " << e.what() << "\n";
+        return 1;
+    }
+
+    auto end = chrono::high_resolution_clock::now();
+    cout << "Shard " << options.shardIndex << "/" << options.shardCount << (options.shardByVideo ? " by video" : " by country")
+        << ": " << videoCount << " videos from " << fileCount << " files, " << tagCount << " tags written to " << path << " in "
+        << chrono::duration_cast<chrono::milliseconds>(end - start).count() << " milliseconds" << "\n";
+    return 0;
+}
+
+//aggregates videos into tag tables like the map report does, but keeps the tables under a
+//memory budget: once their arenas hold more than budgetBytes, the tables are written to the
+//spill directory as a sorted run (a partial aggregate file) and aggregation starts over with
+//empty ones. merge() streams the sums over all runs in country and tag order
+class SpillingAggregator {
+public:
+    SpillingAggregator(size_t budgetBytes, const fs::path& spillRoot)
+        : budgetBytes(budgetBytes), tables(make_unique<TagAggregates>()) {
+        directory = spillRoot / ("project17-spill-" + to_string(chrono::steady_clock::now().time_since_epoch().count()));
+        fs::create_directories(directory);
+    }
+    SpillingAggregator(const SpillingAggregator&) = delete;
+    SpillingAggregator& operator=(const SpillingAggregator&) = delete;
+
+    ~SpillingAggregator() {
+        error_code ignored;
+        fs::remove_all(directory, ignored);
+    }
+
+    //adds the video with its engagement score, see updateTagViewsAndInteractions
+    void add(const Video& video, double engagement) {
+        if (!failure.empty()) {
+            return;
+        }
+        updateTagViewsAndInteractions(video, engagement, tables->countryTagViews, tables->countryTagInteractions);
+        if (tableBytes() > budgetBytes) {
+            spill();
+        }
+    }
+
+    //spills the tables left and calls f(country, tag, views, interaction) for every country
+    //and tag in order. Runs are merged at most maxFanIn at a time, in passes over intermediate
+    //runs if there are more, so the read buffers stay small. Throws runtime_error if a run
+    //could not be written or read back
+    template <class F>
+    void merge(F f) {
+        const size_t maxFanIn = 64;
+        spill();
+        if (!failure.empty()) {
+            throw runtime_error(failure);
+        }
+        while (runs.size() > maxFanIn) {
+            TRACE_SCOPE("spill merge pass");
+            vector<string> inputs(runs.begin(), runs.begin() + maxFanIn);
+            fs::path run = directory / ("run-" + to_string(nextRun++) + ".p17a");
+            {
+                PartialAggregateWriter writer(run);
+                string country;
+                mergePartialAggregates(inputs, [&](const string& tagCountry, const string& tag, long long views, long long interaction) {
+                    if (tagCountry != country) {
+                        writer.beginCountry(tagCountry);
+                        country = tagCountry;
+                    }
+                    writer.add(tag, views, interaction);
+                    });
+                writer.finish();
+            }
+            for (const string& input : inputs) {
+                fs::remove(input);
+            }
+            runs.erase(runs.begin(), runs.begin() + maxFanIn);
+            runs.push_back(run.string());
+            ++mergePasses;
+        }
+        mergePartialAggregates(runs, f);
+    }
+
+    size_t runCount() const { return nextRun; }
+    size_t mergePassCount() const { return mergePasses; }
+    uint64_t spilledBytes() const { return runBytes; }
+    const fs::path& spillDirectory() const { return directory; }
+
+private:
+    size_t tableBytes() const {
+        size_t bytes = 0;
+        for (const map<string, TagTable>* countries : { &tables->countryTagViews, &tables->countryTagInteractions }) {
+            for (const auto& country : *countries) {
+                bytes += country.second.memoryBytes();
+            }
+        }
+        return bytes;
+    }
+
+    void spill() {
+        if (tables->countryTagViews.empty() || !failure.empty()) {
+            return;
+        }
+        TRACE_SCOPE("spill run");
+        fs::path run = directory / ("run-" + to_string(nextRun++) + ".p17a");
+        try {
+            writePartialAggregates(run, *tables);
+            runBytes += fs::file_size(run);
+        }
+        catch (const exception& e) {
+            failure = e.what(); // readArchive would take it for a bad row, so it is raised by merge
+        }
+        runs.push_back(run.string());
+        tables = make_unique<TagAggregates>();
+    }
+
+    size_t budgetBytes;
+    fs::path directory;
+    unique_ptr<TagAggregates> tables;
+    vector<string> runs;
+    size_t nextRun = 0;
+    size_t mergePasses = 0;
+    uint64_t runBytes = 0;
+    string failure;
+};
+
+//keeps the k tags ranked first in a stream of tags and values: highest value first and ties
+//by tag, the order of the report, or with lowestFirst the k ranked last, last one first
+class TopTags {
+public:
+    TopTags(size_t k, bool lowestFirst) : k(k), order{ lowestFirst } {}
+
+    void add(string_view tag, long long value) {
+        if (k == 0 || (tags.size() == k && !order.before(tag, value, tags.front().first, tags.front().second))) {
+            return;
+        }
+        if (tags.size() == k) {
+            pop_heap(tags.begin(), tags.end(), order);
+            tags.pop_back();
+        }
+        tags.emplace_back(tag, value);
+        push_heap(tags.begin(), tags.end(), order);
+    }
+
+    //the tags kept, in their order
+    vector<pair<string, long long>> sorted() const {
+        vector<pair<string, long long>> result = tags;
+        sort(result.begin(), result.end(), order);
+        return result;
+    }
+
+    size_t size() const { return tags.size(); }
+
+private:
+    //ranking order; as the order of the heap it keeps the tag that comes last at its front,
+    //the first to be dropped
+    struct Order {
+        bool lowestFirst;
+
+        bool before(string_view tag, long long value, string_view otherTag, long long otherValue) const {
+            if (value != otherValue) {
+                return lowestFirst ? value < otherValue : value > otherValue;
+            }
+            return lowestFirst ? tag > otherTag : tag < otherTag;
+        }
+
+        bool operator()(const pair<string, long long>& a, const pair<string, long long>& b) const {
+            return before(a.first, a.second, b.first, b.second);
+        }
+    };
+
+    size_t k;
+    Order order;
+    vector<pair<string, long long>> tags;
+};
+
+//the first n and the last n entries of the views and interaction rankings of every country,
+//as rankings holding only those entries: the top, then the bottom in ranking order. A country
+//with at most 2n tags gets its full ranking. printRanking reads them like full rankings
+struct SelectedRankings {
+    map<string, vector<pair<string, int>>> views;
+    map<string, vector<pair<string, int>>> interaction;
+};
+
+vector<pair<string, int>> selectedRanking(const TopTags& top, const TopTags& bottom, size_t tagCount) {
+    vector<pair<string, int>> ranking;
+    for (const auto& entry : top.sorted()) {
+        ranking.emplace_back(entry.first, static_cast<int>(entry.second));
+    }
+    // the bottom entries come last first; the ones already in the top are left out
+    vector<pair<string, long long>> last = bottom.sorted();
+    for (size_t j = min(last.size(), tagCount - top.size()); j-- > 0;) {
+        ranking.emplace_back(last[j].first, static_cast<int>(last[j].second));
+    }
+    return ranking;
+}
+
+//merges the runs of the aggregator and selects the first and last n tags of every ranking
+//while they stream by, so only 4n tags of one country are held at a time
+SelectedRankings selectRankings(SpillingAggregator& aggregator, size_t n) {
+    SelectedRankings selected;
+    string country;
+    size_t tagCount = 0;
+    TopTags topViews(n, false), bottomViews(n, true), topInteraction(n, false), bottomInteraction(n, true);
+    auto endCountry = [&] {
+        if (tagCount != 0) {
+            selected.views[country] = selectedRanking(topViews, bottomViews, tagCount);
+            selected.interaction[country] = selectedRanking(topInteraction, bottomInteraction, tagCount);
+        }
+        tagCount = 0;
+        topViews = TopTags(n, false);
+        bottomViews = TopTags(n, true);
+        topInteraction = TopTags(n, false);
+        bottomInteraction = TopTags(n, true);
+    };
+    aggregator.merge([&](const string& tagCountry, const string& tag, long long views, long long interaction) {
+        if (tagCountry != country) {
+            endCountry();
+            country = tagCountry;
+        }
+        ++tagCount;
+        topViews.add(tag, views);
+        bottomViews.add(tag, views);
+        topInteraction.add(tag, interaction);
+        bottomInteraction.add(tag, interaction);
+        });
+    endCountry();
+    return selected;
+}
+
+//a tag of the merged aggregates
+struct MergedTag {
+    string tag;
+    long long views;
+    long long interaction;
+};
+
+//merges the partial aggregate files given to --merge and reports the final rankings of every
+//country in them, the way the interactive report does, exporting them with --export
+int runMerge(const Options& options) {
+    if (options.mergeInputs.empty()) {
+        cerr << "--merge needs the partial aggregate files to merge" << "\n";
+        return 1;
+    }
+    auto start = chrono::high_resolution_clock::now();
+    map<string, vector<MergedTag>> countries;
+    unique_ptr<TagStatsTables> tagStats;
+    if (!options.tagStatsMetric.empty()) {
+        tagStats = make_unique<TagStatsTables>();
+    }
+    try {
+        unique_ptr<PartialAggregateWriter> merged;
+        if (!options.partialPath.empty()) {
+            merged = make_unique<PartialAggregateWriter>(options.partialPath);
+        }
+        mergePartialAggregates(options.mergeInputs, [&](const string& country, const string& tag, long long views, long long interaction) {
+            vector<MergedTag>& tags = countries[country];
+            if (merged) {
+                if (tags.empty()) {
+                    merged->beginCountry(country);
+                }
+                merged->add(tag, views, interaction);
+                if (tagStats) {
+                    auto table = tagStats->countries.find(country);
+                    if (table != tagStats->countries.end()) {
+                        auto entry = table->second.find(tag);
+                        if (entry != table->second.end()) {
+                            merged->addStats(entry->second);
+                        }
+                    }
+                }
+            }
+            tags.push_back({ tag, views, interaction });
+            }, tagStats.get());
+        if (merged) {
+            merged->finish();
+        }
+    }
+    catch (const exception& e) {
+        cerr << "Merge failed: " << e.what() << "\n";
+        return 1;
+    }
+    size_t tagCount = 0;
+    for (const auto& country : countries) {
+        tagCount += country.second.size();
+    }
+    auto end = chrono::high_resolution_clock::now();
+    cout << "Time taken to merge " << options.mergeInputs.size() << " partial aggregate files into " << tagCount << " tags: "
+        << chrono::duration_cast<chrono::milliseconds>(end - start).count() << " milliseconds" << "\n";
+    if (tagStats && tagStats->countries.empty() && tagCount > 0) {
+        cerr << "The partial files hold no tag statistics, write them with --shard and --tag-stats" << "\n";
+    }
+
+    try {
+        if (!options.exportPath.empty()) {
+            fs::create_directories(options.exportPath);
+        }
+        ReportWriter report(stdout);
+        for (const auto& country : countries) {
+            vector<pair<string_view, long long>> byViews;
+            vector<pair<string_view, long long>> byInteraction;
+            for (const MergedTag& tag : country.second) {
+                byViews.emplace_back(tag.tag, tag.views);
+                byInteraction.emplace_back(tag.tag, tag.interaction);
+            }
+            sortRanking(byViews);
+            sortRanking(byInteraction);
+
+            report << "\nCountry: " << country.first << '\n';
+            printRanking(report, "Top 25 keywords/tags for views:", byViews, 25, false);
+            printRanking(report, "Top 25 keywords/tags to avoid for views:", byViews, 25, true);
+            printRanking(report, "Top 25 keywords/tags for positive interaction:", byInteraction, 25, false);
+            printRanking(report, "Top 25 keywords/tags to avoid for positive interaction:", byInteraction, 25, true);
+            if (tagStats) {
+                const TagStatsTable& table = tagStats->countries[country.first];
+                printTagStatsRanking(report, table, options.tagStatsMetric, options.tagStatsMinVideos, 25);
+                if (!options.exportPath.empty()) {
+                    exportTagStats(options.exportPath, country.first + "_tag_stats", table, options.exportFormat);
+                }
+            }
+            if (!options.exportPath.empty()) {
+                exportRanking(options.exportPath, country.first + "_views", byViews, options.exportFormat, "views");
+                exportRanking(options.exportPath, country.first + "_interaction", byInteraction, options.exportFormat, "interaction");
+            }
+        }
+    }
+    catch (const exception& e) {
+        cerr << "Export failed: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    Options options = parseOptions(argc, argv);
+    string foldername = "archive"; // Replace with the name of the folder containing the dataset files
+    vector<Video> videos;
+    vector<pair<string, ProcessMemory>> memoryPhases;
+    recordMemoryPhase(memoryPhases, "start");
+
+    if (!options.servePath.empty()) {
+#ifndef _WIN32
+        int status = runQueryServer(foldername, options.inputMode, options.servePath);
+        reportTrace(options);
+        return status;
+#else
+        cerr << "The query server needs Unix sockets and is not available on Windows" << "\n";
+        return 1;
+#endif
+    }
+    if (options.shardCount > 0 || options.merge) {
+        int status = options.merge ? runMerge(options) : runShard(foldername, options);
+        reportTrace(options);
+        return status;
+    }
+
+    cout << "Choose a data structure for parsing (map or bst): ";
+    string dataStructure;
+    getline(cin, dataStructure);
+    transform(dataStructure.begin(), dataStructure.end(), dataStructure.begin(), ::tolower);
+
+    while (dataStructure != "map" && dataStructure != "bst") {
+        cout << "Please choose a valid data structure (map or bst): ";
+        getline(cin, dataStructure);
+        transform(dataStructure.begin(), dataStructure.end(), dataStructure.begin(), ::tolower);
+    }
+
+    // The countries come from the file names, so the selection is known before anything is read
+    set<string> countries;
+    for (const auto& entry : fs::directory_iterator(foldername)) {
+        if (isCsvFile(entry.path())) {
+            countries.insert(fileCountry(entry.path()));
+        }
+    }
+
+    cout << "Available countries: ";
+    for (const string& country : countries) {
+        cout << country << " ";
+    }
+    cout << "\n";
+
+    bool spills = options.memoryBudget > 0 && dataStructure == "map" && !options.pipeline && options.coroutineThreads == 0;
+    vector<string> selectedCountries;
+    while (selectedCountries.empty()) {
+        cout << "Select countries (use comma-separated values, join countries with + for their union, ALL for every country): ";
+        string input;
+        if (!getline(cin, input)) {
+            return 1;
+        }
+        selectedCountries = validateAndConvertCountryInput(input, countries);
+        if (selectedCountries.empty()) {
+            cout << "Invalid country selection: " << input << "\n";
+        }
+        else if (spills && any_of(selectedCountries.begin(), selectedCountries.end(), [](const string& token) {
+            return token.find('+') != string::npos;
+            })) {
+            // only the rankings of single countries and of all of them are kept once the tables spill
+            cout << "Unions of countries are not available with --memory-budget" << "\n";
+            selectedCountries.clear();
+        }
+    }
+
+    // Only the files of the selected countries are read, unless a feature covers every country
+    IngestQuery query;
+    query.firstDate = options.firstDate;
+    query.lastDate = options.lastDate;
+    if (options.dateIndex) {
+        query.indexDirectory = options.dateIndexPath.empty() ? foldername : options.dateIndexPath;
+    }
+    if (options.exportPath.empty() && options.columnarPath.empty() && !options.tagSearch
+        && find(selectedCountries.begin(), selectedCountries.end(), "ALL") == selectedCountries.end()) {
+        for (const string& selection : selectedCountries) {
+            for (const string& country : split(selection, '+')) {
+                query.countries.insert(country);
+            }
+        }
+    }
+
+    auto start = chrono::high_resolution_clock::now();
+
+    CountingResource treeMemory;
+    pmr::monotonic_buffer_resource treeArena(&treeMemory); // owns every TreeNode
+    TreeNode* countryTagViewsRoot = nullptr;
+    TreeNode* countryTagInteractionsRoot = nullptr;
+
+    unique_ptr<SpillingAggregator> spilling;
+    if (options.memoryBudget > 0) {
+        if (!spills) {
+            cerr << "--memory-budget only applies to the map report without --pipeline or --coroutines, aggregating in memory" << "\n";
+        }
+        else {
+            try {
+                spilling = make_unique<SpillingAggregator>(options.memoryBudget,
+                    options.spillPath.empty() ? fs::temp_directory_path() : fs::path(options.spillPath));
+            }
+            catch (const exception& e) {
+                cerr << "Can not spill the tag tables: " << e.what() << "\n";
+                return 1;
+            }
+        }
+    }
+    SelectedRankings spilledRankings;
+
+    unique_ptr<TagStatsTables> tagStats;
+    if (!options.tagStatsMetric.empty()) {
+        tagStats = make_unique<TagStatsTables>();
+    }
+
+    unique_ptr<ColumnarVideoExport> columnar;
+    if (!options.columnarPath.empty()) {
+        try {
+            fs::create_directories(options.columnarPath);
+            columnar = make_unique<ColumnarVideoExport>(options.columnarPath);
+        }
+        catch (const exception& e) {
+            cerr << "Columnar export failed: " << e.what() << "\n";
+        }
+    }
+
+    {
+        TRACE_SCOPE("ingest");
+        if (options.pipeline) {
+            runIngestPipeline(foldername, options.inputMode, query, options.pipelineThreads, dataStructure, videos,
+                countryTagViewsRoot, countryTagInteractionsRoot, treeArena, columnar.get(), tagStats.get());
+        }
+#if CSV_IO_HAS_COROUTINES
+        else if (options.coroutineThreads > 0) {
+            runCoroutineIngest(foldername, options.inputMode, query, options.coroutineThreads, dataStructure, videos,
+                countryTagViewsRoot, countryTagInteractionsRoot, treeArena, columnar.get(), tagStats.get());
+        }
+#endif
+        else {
+            readArchive(foldername, options.inputMode, query, [&](const fs::path& path) { return query.wantsFile(path); }, [&](const Video& video, double engagement) {
+                if (spilling) {
+                    spilling->add(video, engagement);
+                    return;
+                }
+                videos.push_back(video);
+                if (columnar) {
+                    columnar->add(video);
+                }
+
+                if (dataStructure == "map") {
+                    updateTagViewsAndInteractions(video, engagement, countryTagViews, countryTagInteractions);
+                }
+                else {
+                    updateTagViewsAndInteractionsBST(video, engagement, countryTagViewsRoot, countryTagInteractionsRoot, treeArena);
+                }
+                if (tagStats) {
+                    updateTagStats(video, *tagStats);
+                }
+                });
+        }
+        if (spilling) {
+            try {
+                spilledRankings = selectRankings(*spilling, 25);
+            }
+            catch (const exception& e) {
+                cerr << "Merging the spilled tag tables failed: " << e.what() << "\n";
+                return 1;
+            }
+        }
+    }
+    TRACE_COUNT("distinct tags", dataStructure == "map" ? sortedTagUnion(countryTagViews).size() : countryTagViewsRoot ? countryTagViewsRoot->size() : 0);
+
+    // the tag tables of every country as arrays, built when tags over several countries are asked for
+    unique_ptr<CountryTagArrays> countryTagArrays;
+    auto tagArrays = [&]() -> const CountryTagArrays& {
+        if (!countryTagArrays) {
+            countryTagArrays = make_unique<CountryTagArrays>(countryTagViews, countryTagInteractions);
+        }
+        return *countryTagArrays;
+    };
+    vector<string> allCountries;
+    for (const auto& country : countryTagViews) {
+        allCountries.push_back(country.first);
+    }
+
+
+    auto end = chrono::high_resolution_clock::now();
+    auto duration = chrono::duration_cast<chrono::milliseconds>(end - start).count();
+
+    cout << "Time taken to parse data using " << dataStructure << ": " << duration << " milliseconds" << "\n";
+    recordMemoryPhase(memoryPhases, "ingest");
+    cout << "Peak resident memory after ingest: " << memoryPhases.back().second.peakResidentBytes / (1024 * 1024) << " MB" << "\n";
+    if (spilling) {
+        cout << "Tag tables spilled to " << spilling->spillDirectory().string() << ": " << spilling->runCount() << " sorted runs, "
+            << spilling->spilledBytes() / 1024 << " KB, " << spilling->mergePassCount() + 1 << " merge passes" << "\n";
+        spilling.reset();
+    }
+
+    if (columnar) {
+        auto columnarStart = chrono::high_resolution_clock::now();
+        try {
+            uint64_t videoRows = columnar->finish();
+            columnar.reset();
+            vector<pair<string, vector<pair<string, int>>>> views, interaction;
+            if (dataStructure == "map") {
+                for (const auto& country : countryTagViews) {
+                    views.emplace_back(country.first, country.second.entries());
+                    interaction.emplace_back(country.first, countryTagInteractions[country.first].entries());
+                }
+                views.emplace_back("all", vector<pair<string, int>>());
+                interaction.emplace_back("all", vector<pair<string, int>>());
+                tagArrays().entries(allCountries, views.back().second, interaction.back().second);
+            }
+            else {
+                // the trees are not kept per country
+                views.emplace_back("all", vector<pair<string, int>>());
+                interaction.emplace_back("all", vector<pair<string, int>>());
+                inOrderTraversal(countryTagViewsRoot, views.back().second);
+                inOrderTraversal(countryTagInteractionsRoot, interaction.back().second);
+            }
+            uint64_t tagRows = exportColumnarTags(options.columnarPath, views, interaction);
+            auto columnarEnd = chrono::high_resolution_clock::now();
+            cout << "Columnar export: " << videoRows << " videos streamed during ingest, " << tagRows << " tag rows written in "
+                << chrono::duration_cast<chrono::milliseconds>(columnarEnd - columnarStart).count() << " milliseconds to "
+                << options.columnarPath << "\n";
+        }
+        catch (const exception& e) {
+            cerr << "Columnar export failed: " << e.what() << "\n";
+        }
+    }
+
+    // the countries of a selection
+    auto selectionCountries = [&](const string& selection) {
+        return selection == "ALL" ? allCountries : split(selection, '+');
+    };
+
+    // Each selection is reported and exported once
+    set<string> selectedCountriesSet(selectedCountries.begin(), selectedCountries.end());
+
+    map<string, TagCooccurrence> cooccurrence;
+    if (options.cooccurrenceTopM > 0) {
+        auto cooccurrenceStart = chrono::high_resolution_clock::now();
+        cooccurrence = buildCountryTagCooccurrence(videos, options.cooccurrenceTopM);
+        auto cooccurrenceEnd = chrono::high_resolution_clock::now();
+        cout << "Time taken to build the tag co-occurrence matrix (top " << options.cooccurrenceTopM << " tags): "
+            << chrono::duration_cast<chrono::milliseconds>(cooccurrenceEnd - cooccurrenceStart).count() << " milliseconds" << "\n";
+        recordMemoryPhase(memoryPhases, "co-occurrence build");
+    }
+
+    for (const string& country : selectedCountries) {
+        bool singleCountry = country != "ALL" && country.find('+') == string::npos;
+        ReportWriter report(stdout);
+        report << "\nCountry: " << country << '\n';
+        auto printRankings = [&](const auto& viewsRanking, const auto& interactionRanking) {
+            printRanking(report, "Top 25 keywords/tags for views:", viewsRanking, 25, false);
+            printRanking(report, "Top 25 keywords/tags to avoid for views:", viewsRanking, 25, true);
+            printRanking(report, "Top 25 keywords/tags for positive interaction:", interactionRanking, 25, false);
+            printRanking(report, "Top 25 keywords/tags to avoid for positive interaction:", interactionRanking, 25, true);
+        };
+        // One full ranking per table gives both the top and the bottom 25
+        if (!spilledRankings.views.empty()) {
+            string key = singleCountry ? country : "all";
+            printRankings(spilledRankings.views[key], spilledRankings.interaction[key]);
+        }
+        else if (dataStructure == "map" && singleCountry) {
+            printRankings(topNElements(countryTagViews[country], countryTagViews[country].size()),
+                topNElements(countryTagInteractions[country], countryTagInteractions[country].size()));
+        }
+        else if (dataStructure == "map") {
+            // summed over the countries, the sums need not fit in an int
+            vector<pair<string_view, long long>> viewsRanking, interactionRanking;
+            tagArrays().rank(selectionCountries(country), viewsRanking, interactionRanking);
+            printRankings(viewsRanking, interactionRanking);
+        }
+        else {
+            printRankings(topNElementsFromBST(countryTagViewsRoot, SIZE_MAX), topNElementsFromBST(countryTagInteractionsRoot, SIZE_MAX));
+        }
+        if (tagStats) {
+            printTagStatsRanking(report, singleCountry ? tagStats->countries[country] : tagStats->merged(selectionCountries(country)),
+                options.tagStatsMetric, options.tagStatsMinVideos, 25);
+        }
+        report.flush();
+
+        // Tags most associated with a tag the user asks for
+        if (options.cooccurrenceTopM > 0 && singleCountry) {
+            const TagCooccurrence& matrix = cooccurrence[country];
+            for (;;) {
+                cout << "\nEnter a tag to list the tags most associated with it in " << country << " (leave empty to continue): ";
+                string tag;
+                if (!getline(cin, tag) || tag.empty()) {
+                    break;
+                }
+                string folded = foldTag(tag);
+                auto queryStart = chrono::high_resolution_clock::now();
+                auto related = matrix.mostAssociated(folded, 25);
+                auto queryEnd = chrono::high_resolution_clock::now();
+                if (related.empty()) {
+                    if (matrix.tags.find(folded) < 0) {
+                        cout << "\"" << tag << "\" is not among the top " << options.cooccurrenceTopM << " tags of " << country << "\n";
+                    }
+                    else {
+                        cout << "\"" << tag << "\" never appears together with another of the top " << options.cooccurrenceTopM
+                            << " tags of " << country << "\n";
+                    }
+                    continue;
+                }
+                cout << "Tags most associated with \"" << tag << "\" (views shared, looked up in "
+                    << chrono::duration_cast<chrono::microseconds>(queryEnd - queryStart).count() << " microseconds):" << "\n";
+                for (const auto& entry : related) {
+                    cout << entry.first << ": " << entry.second << "\n";
+                }
+            }
+        }
+    }
+    recordMemoryPhase(memoryPhases, "report");
+
+    if (!options.exportPath.empty()) {
+        auto exportStart = chrono::high_resolution_clock::now();
+        size_t exportedRows = 0;
+        try {
+            fs::create_directories(options.exportPath);
+            auto exportTables = [&](const string& name, const auto& views, const auto& interaction) {
+                exportRanking(options.exportPath, name + "_views", views, options.exportFormat, "views");
+                exportRanking(options.exportPath, name + "_interaction", interaction, options.exportFormat, "interaction");
+                exportedRows += views.size() + interaction.size();
+            };
+            // single countries from their tables, unions and "all" from the country tag arrays
+            set<string> exported = selectedCountriesSet;
+            exported.erase("ALL");
+            exported.insert("all");
+            if (dataStructure == "map") {
+                for (const string& country : exported) {
+                    if (countryTagViews.count(country)) {
+                        exportTables(country, rankTags(countryTagViews[country]), rankTags(countryTagInteractions[country]));
+                        continue;
+                    }
+                    vector<pair<string_view, long long>> views, interaction;
+                    tagArrays().rank(selectionCountries(country == "all" ? "ALL" : country), views, interaction);
+                    exportTables(country, views, interaction);
+                }
+            }
+            else {
+                // the trees are not kept per country
+                exportTables("all", rankTags(countryTagViewsRoot), rankTags(countryTagInteractionsRoot));
+            }
+            if (tagStats) {
+                for (const string& country : exported) {
+                    TagStatsTable merged;
+                    const TagStatsTable* table = &merged;
+                    if (tagStats->countries.count(country)) {
+                        table = &tagStats->countries[country];
+                    }
+                    else {
+                        merged = tagStats->merged(selectionCountries(country == "all" ? "ALL" : country));
+                    }
+                    exportTagStats(options.exportPath, country + "_tag_stats", *table, options.exportFormat);
+                    exportedRows += table->size();
+                }
+            }
+        }
+        catch (const exception& e) {
+            cerr << "Export failed: " << e.what() << "\n";
+        }
+        auto exportEnd = chrono::high_resolution_clock::now();
+        cout << "\nTime taken to export " << exportedRows << " rows to " << options.exportPath << ": "
+            << chrono::duration_cast<chrono::milliseconds>(exportEnd - exportStart).count() << " milliseconds" << "\n";
+    }
+
+    if (options.tagSearch) {
+        auto indexStart = chrono::high_resolution_clock::now();
+        TagSearchIndex searchIndex;
+        if (dataStructure == "map") {
+            vector<pair<string, int>> tagViews;
+            vector<pair<string, int>> tagInteraction;
+            tagArrays().entries(allCountries, tagViews, tagInteraction);
+            searchIndex = TagSearchIndex(tagViews, tagInteraction);
+        }
+        else {
+            vector<pair<string, int>> tagViews;
+            vector<pair<string, int>> tagInteraction;
+            inOrderTraversal(countryTagViewsRoot, tagViews);
+            inOrderTraversal(countryTagInteractionsRoot, tagInteraction);
+            searchIndex = TagSearchIndex(tagViews, tagInteraction);
+        }
+        auto indexEnd = chrono::high_resolution_clock::now();
+        cout << "\nTime taken to index " << searchIndex.size() << " tags for search: "
+            << chrono::duration_cast<chrono::milliseconds>(indexEnd - indexStart).count() << " milliseconds" << "\n";
+        recordMemoryPhase(memoryPhases, "search index build");
+
+        for (;;) {
+            cout << "\nSearch tags (\"mine\" for tags starting with it, \"*mine*\" for tags containing it, leave empty to finish): ";
+            string query;
+            if (!getline(cin, query) || query.empty()) {
+                break;
+            }
+            auto queryStart = chrono::high_resolution_clock::now();
+            vector<TagSearchResult> results;
+            if (query.size() >= 2 && query.front() == '*' && query.back() == '*') {
+                results = searchIndex.containing(foldTag(string_view(query).substr(1, query.size() - 2)), 25);
+            }
+            else {
+                results = searchIndex.withPrefix(foldTag(query), 25);
+            }
+            auto queryEnd = chrono::high_resolution_clock::now();
+            cout << "Top " << results.size() << " matching tags by views (looked up in "
+                << chrono::duration_cast<chrono::microseconds>(queryEnd - queryStart).count() << " microseconds):" << "\n";
+            for (const TagSearchResult& result : results) {
+                cout << result.tag << ": " << result.views << " views, " << result.interaction << " interaction" << "\n";
+            }
+        }
+    }
+
+    vector<const TagTable*> allTables;
+    for (const map<string, TagTable>* tables : { &countryTagViews, &countryTagInteractions }) {
+        for (const auto& country : *tables) {
+            allTables.push_back(&country.second);
+        }
+    }
+    size_t treeNodes = 0;
+    for (TreeNode* root : { countryTagViewsRoot, countryTagInteractionsRoot }) {
+        treeNodes += root ? root->size() : 0;
+    }
+    printMemoryReport({
+        videosMemory(videos),
+        tagTablesMemory("per-country tag views", countryTagViews),
+        tagTablesMemory("per-country tag interaction", countryTagInteractions),
+        tagStringsMemory(allTables),
+        { "country tag arrays", countryTagArrays ? countryTagArrays->tagCount() : 0, countryTagArrays ? countryTagArrays->memoryBytes() : 0 },
+        { "BST nodes", treeNodes, treeMemory.bytes() },
+        cooccurrenceMemory(cooccurrence),
+        tagStatsMemory(tagStats.get()) }, memoryPhases);
+
+    reportTrace(options);
+    return 0;
+}
@@ -36,19 +36,86 @@
 #include <cstdio>
 #include <cstring>
 #include <exception>
+#include <functional>
 #include <string>
 #include <utility>
 #include <vector>
 #ifndef CSV_IO_NO_THREAD
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <mutex>
 #include <thread>
+#ifdef __linux__
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <new>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <unistd.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && !defined(CSV_IO_NO_IO_URING)
+#include <linux/io_uring.h>
+#define CSV_IO_HAS_IO_URING 1
+#endif
+#endif
+#ifndef CSV_IO_HAS_IO_URING
+#define CSV_IO_HAS_IO_URING 0
+#endif
+#endif
 #endif
 #include <cassert>
 #include <cerrno>
 #include <istream>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
 #include <limits>
 #include <memory>
+#include <system_error>
+
+#ifdef CSV_IO_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CSV_IO_WITH_ZSTD
+#include <deque>
+#include <future>
+#include <zstd.h>
+#endif
+
+// Coroutine row streams need C++20 coroutines and a thread for read-ahead.
+#if defined(__cpp_impl_coroutine) && !defined(CSV_IO_NO_THREAD) &&            \
+    defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#include <iterator>
+#define CSV_IO_HAS_COROUTINES 1
+#endif
+#endif
+#ifndef CSV_IO_HAS_COROUTINES
+#define CSV_IO_HAS_COROUTINES 0
+#endif
+
+// Number of block buffers the asynchronous reader may fill ahead of the parser.
+#ifndef CSV_IO_PREFETCH_BLOCK_COUNT
+#define CSV_IO_PREFETCH_BLOCK_COUNT 4
+#endif
+
+// Instrumentation hooks, empty unless defined before including this file.
+// CSV_IO_TRACE_SCOPE(name) starts a timer at the point it appears that stops
+// at the end of the enclosing scope, CSV_IO_TRACE_COUNT(name, amount) adds
+// amount to a counter. name is a string literal.
+#ifndef CSV_IO_TRACE_SCOPE
+#define CSV_IO_TRACE_SCOPE(name)
+#endif
+#ifndef CSV_IO_TRACE_COUNT
+#define CSV_IO_TRACE_COUNT(name, amount)
+#endif
 
 namespace io {
 ////////////////////////////////////////////////////////////////////////////
@@ -123,11 +190,30 @@ struct line_length_limit_exceeded : base, with_file_name, with_file_line {
         file_line, file_name);
   }
 };
+
+struct corrupt_compressed_file : base, with_file_name {
+  void format_error_message() const override {
+    std::snprintf(error_message_buffer, sizeof(error_message_buffer),
+                  "The compressed data in file \"%s\" is corrupt or truncated.",
+                  file_name);
+  }
+};
+
+struct can_not_read_file : base, with_file_name, with_errno {
+  void format_error_message() const override {
+    std::snprintf(error_message_buffer, sizeof(error_message_buffer),
+                  "Can not read file \"%s\" because \"%s\".", file_name,
+                  std::strerror(errno_value));
+  }
+};
 } // namespace error
 
 class ByteSourceBase {
 public:
   virtual int read(char *buffer, int size) = 0;
+  // Sources that keep their own reads in flight return true, so that the
+  // LineReader calls read directly instead of from a read-ahead thread.
+  virtual bool reads_ahead() const { return false; }
   virtual ~ByteSourceBase() {}
 };
 
@@ -185,82 +271,381 @@ private:
   long long remaining_byte_count;
 };
 
+// Every block buffer has room for block_len bytes of the previous block in front
+// of the block_len bytes read into it. When a line crosses a block boundary, only
+// its unfinished part is copied in front of the next block and parsing continues
+// in that buffer; the trailing byte holds the '\0' written after an unterminated
+// last line.
+const int block_len = 1 << 20;
+const int block_buffer_len = 2 * block_len + 1;
+
 #ifndef CSV_IO_NO_THREAD
-class AsynchronousReader {
+// Blocks until value is no longer equal to old.
+inline void wait_for_change(const std::atomic<unsigned> &value, unsigned old) {
+#if defined(__cpp_lib_atomic_wait)
+  value.wait(old, std::memory_order_acquire);
+#else
+  for (int spin = 0; value.load(std::memory_order_acquire) == old; ++spin) {
+    if (spin < 64)
+      std::this_thread::yield();
+    else
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+#endif
+}
+
+inline void notify_change(std::atomic<unsigned> &value) {
+#if defined(__cpp_lib_atomic_wait)
+  value.notify_all();
+#else
+  (void)value;
+#endif
+}
+
+} // namespace detail
+
+// Block buffers recycled by the readers that share the pool. At most
+// buffer_count of them exist at once, acquire blocks while all are in use. A
+// reader holds one buffer from its construction on and a second one once its
+// input turns out to be longer than a block, until it is destroyed, so a
+// thread must not keep more readers open than the pool can serve.
+class BlockBufferPool {
 public:
-  void init(std::unique_ptr<ByteSourceBase> arg_byte_source) {
-    std::unique_lock<std::mutex> guard(lock);
-    byte_source = std::move(arg_byte_source);
-    desired_byte_count = -1;
-    termination_requested = false;
-    worker = std::thread([&] {
-      std::unique_lock<std::mutex> guard(lock);
-      try {
-        for (;;) {
-          read_requested_condition.wait(guard, [&] {
-            return desired_byte_count != -1 || termination_requested;
-          });
-          if (termination_requested)
-            return;
-
-          read_byte_count = byte_source->read(buffer, desired_byte_count);
-          desired_byte_count = -1;
-          if (read_byte_count == 0)
-            break;
-          read_finished_condition.notify_one();
-        }
-      } catch (...) {
-        read_error = std::current_exception();
-      }
-      read_finished_condition.notify_one();
-    });
+  explicit BlockBufferPool(unsigned buffer_count)
+      : buffer_count(buffer_count) {}
+
+  BlockBufferPool(const BlockBufferPool &) = delete;
+  BlockBufferPool &operator=(const BlockBufferPool &) = delete;
+
+  char *acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (free_buffers.empty() && owned.size() < buffer_count) {
+      owned.emplace_back(new char[detail::block_buffer_len]);
+      return owned.back().get();
+    }
+    returned.wait(lock, [&] { return !free_buffers.empty(); });
+    char *buffer = free_buffers.back();
+    free_buffers.pop_back();
+    return buffer;
   }
 
-  bool is_valid() const { return byte_source != nullptr; }
+  void release(char *buffer) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      free_buffers.push_back(buffer);
+    }
+    returned.notify_one();
+  }
 
-  void start_read(char *arg_buffer, int arg_desired_byte_count) {
-    std::unique_lock<std::mutex> guard(lock);
-    buffer = arg_buffer;
-    desired_byte_count = arg_desired_byte_count;
-    read_byte_count = -1;
-    read_requested_condition.notify_one();
+  // Buffers allocated so far, each detail::block_buffer_len bytes.
+  std::size_t allocated_count() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return owned.size();
   }
 
-  int finish_read() {
-    std::unique_lock<std::mutex> guard(lock);
-    read_finished_condition.wait(
-        guard, [&] { return read_byte_count != -1 || read_error; });
-    if (read_error)
-      std::rethrow_exception(read_error);
-    else
-      return read_byte_count;
+private:
+  const unsigned buffer_count;
+  std::mutex mutex;
+  std::condition_variable returned;
+  std::vector<std::unique_ptr<char[]>> owned;
+  std::vector<char *> free_buffers;
+};
+
+// A fixed number of threads that run the read-ahead of any number of readers,
+// in the order it is submitted. Must outlive the readers that use it.
+class IOThreadPool {
+public:
+  explicit IOThreadPool(unsigned thread_count) {
+    for (unsigned i = 0; i < (std::max)(1u, thread_count); ++i)
+      workers.emplace_back([this] { run(); });
   }
 
-  ~AsynchronousReader() {
-    if (byte_source != nullptr) {
+  IOThreadPool(const IOThreadPool &) = delete;
+  IOThreadPool &operator=(const IOThreadPool &) = delete;
+
+  void submit(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.push_back(std::move(task));
+    }
+    submitted.notify_one();
+  }
+
+  ~IOThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    submitted.notify_all();
+    for (auto &worker : workers)
+      worker.join();
+  }
+
+private:
+  void run() {
+    for (;;) {
+      std::function<void()> task;
       {
-        std::unique_lock<std::mutex> guard(lock);
-        termination_requested = true;
+        std::unique_lock<std::mutex> lock(mutex);
+        submitted.wait(lock, [&] { return stopping || !tasks.empty(); });
+        if (tasks.empty())
+          return;
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable submitted;
+  std::deque<std::function<void()>> tasks;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+};
+
+// The pools a reader takes its block buffers and read-ahead from instead of
+// allocating its own buffers and starting its own thread. Either may be null.
+struct ReadPools {
+  IOThreadPool *threads = nullptr;
+  BlockBufferPool *buffers = nullptr;
+};
+
+namespace detail {
+// Reads ahead into a ring of CSV_IO_PREFETCH_BLOCK_COUNT block buffers on a
+// worker thread. The worker is the only writer of produced and the parser the
+// only writer of consumed and released, so handing a block over is one atomic
+// store on each side and never takes a lock.
+//
+// With pools, the ring is two buffers from the buffer pool and the reads run
+// as tasks on the I/O pool, one at a time per reader: a read submits the next
+// one when it finishes and a slot is free, release_block when it frees one.
+class AsynchronousReader {
+public:
+  void init(std::unique_ptr<ByteSourceBase> arg_byte_source,
+            ReadPools arg_pools = ReadPools()) {
+    byte_source = std::move(arg_byte_source);
+    pools = arg_pools;
+    ring_size = pools.buffers ? 2 : slot_count;
+    // Only the first buffer is allocated up front, small inputs never need
+    // the others.
+    slots[0].buffer = allocate_buffer();
+    for (auto &slot : slots)
+      slot.byte_count = 0;
+    produced.store(0);
+    consumed = 0;
+    released.store(0);
+    termination_requested.store(false);
+    next_read = 1;
+    read_in_flight = false;
+    pooled_reads = false;
+
+    // Files that fit into one block and sources that read ahead on their own
+    // are read right here, without a thread.
+    slots[0].byte_count =
+        byte_source->read(slots[0].buffer + block_len, block_len);
+    produced.store(1);
+    if (slots[0].byte_count == block_len && !byte_source->reads_ahead()) {
+      for (unsigned i = 0; i < ring_size; ++i)
+        if (!slots[i].buffer)
+          slots[i].buffer = allocate_buffer();
+      if (pools.threads) {
+        pooled_reads = true;
+        schedule_read();
+      } else {
+        worker = std::thread([&] { read_ahead(); });
+      }
+    }
+  }
+
+  // Returns the buffer of the next block, whose bytes are at
+  // [block_len, block_len + byte_count). byte_count is 0 at the end of the
+  // input. The buffer stays valid until it is handed back by release_block.
+  char *next_block(int &byte_count) {
+    if (!worker.joinable() && !pooled_reads && consumed == produced.load()) {
+      Slot &previous = slots[(consumed + ring_size - 1) % ring_size];
+      Slot &slot = slots[consumed % ring_size];
+      if (!slot.buffer)
+        slot.buffer = allocate_buffer();
+      slot.byte_count =
+          previous.byte_count == 0
+              ? 0
+              : byte_source->read(slot.buffer + block_len, block_len);
+      produced.store(consumed + 1);
+    }
+    while (produced.load(std::memory_order_acquire) == consumed)
+      wait_for_change(produced, consumed);
+    Slot &slot = slots[consumed % ring_size];
+    ++consumed;
+    if (slot.read_error)
+      std::rethrow_exception(slot.read_error);
+    byte_count = slot.byte_count;
+    return slot.buffer;
+  }
+
+  // Hands the oldest block returned by next_block back to the worker.
+  void release_block() {
+    released.fetch_add(1, std::memory_order_release);
+    notify_change(released);
+    if (pooled_reads)
+      schedule_read();
+  }
+
+  // True if next_block returns without waiting for a read ahead. Without
+  // read-ahead next_block reads the block itself.
+  bool block_ready() const {
+    return consumed != produced.load(std::memory_order_acquire) ||
+           (!worker.joinable() && !pooled_reads);
+  }
+
+  // Calls wake once block_ready is true, right away if it already is, else on
+  // the thread that completes the read. wake must not call into the reader.
+  void when_block_ready(std::function<void()> wake) {
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex);
+      if (!block_ready()) {
+        pending_wake = std::move(wake);
+        return;
       }
-      read_requested_condition.notify_one();
+    }
+    wake();
+  }
+
+  ~AsynchronousReader() {
+    if (worker.joinable()) {
+      termination_requested.store(true);
+      released.fetch_add(1);
+      notify_change(released);
       worker.join();
     }
+    if (pooled_reads) {
+      std::unique_lock<std::mutex> lock(schedule_mutex);
+      termination_requested.store(true);
+      read_done.wait(lock, [&] { return !read_in_flight; });
+    }
+    for (auto &slot : slots) {
+      if (slot.buffer && pools.buffers)
+        pools.buffers->release(slot.buffer);
+      else
+        delete[] slot.buffer;
+    }
   }
 
 private:
+  static const unsigned slot_count = CSV_IO_PREFETCH_BLOCK_COUNT;
+  static_assert(slot_count >= 2, "the parser holds up to two blocks at once");
+
+  struct Slot {
+    char *buffer = nullptr;
+    int byte_count;
+    std::exception_ptr read_error;
+  };
+
+  // Called by the reading side after it produced a block.
+  void wake_waiter() {
+    std::function<void()> wake;
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex);
+      wake.swap(pending_wake);
+    }
+    if (wake)
+      wake();
+  }
+
+  char *allocate_buffer() {
+    return pools.buffers ? pools.buffers->acquire()
+                         : new char[block_buffer_len];
+  }
+
+  void read_ahead() {
+    for (unsigned next = 1;; ++next) {
+      unsigned free_from;
+      while (next - (free_from = released.load(std::memory_order_acquire)) >=
+             ring_size) {
+        if (termination_requested.load())
+          return;
+        wait_for_change(released, free_from);
+      }
+      if (termination_requested.load())
+        return;
+
+      bool more = read_block(slots[next % ring_size]);
+      produced.store(next + 1, std::memory_order_release);
+      notify_change(produced);
+      wake_waiter();
+      if (!more)
+        return;
+    }
+  }
+
+  // Reads the next block into slot. Returns false at the end of the input.
+  bool read_block(Slot &slot) {
+    try {
+      slot.byte_count =
+          byte_source->read(slot.buffer + block_len, block_len);
+    } catch (...) {
+      slot.byte_count = 0;
+      slot.read_error = std::current_exception();
+    }
+    return slot.byte_count != 0;
+  }
+
+  // Submits the read of the next block to the I/O pool unless one is in
+  // flight, the input has ended or no slot is free.
+  void schedule_read() {
+    std::lock_guard<std::mutex> lock(schedule_mutex);
+    submit_read_locked();
+  }
+
+  void submit_read_locked() {
+    if (read_in_flight || termination_requested.load() ||
+        slots[(next_read - 1) % ring_size].byte_count == 0 ||
+        next_read - released.load(std::memory_order_acquire) >= ring_size)
+      return;
+    read_in_flight = true;
+    pools.threads->submit([this] { pooled_read(); });
+  }
+
+  // Runs on the I/O pool. Everything after the read happens under the lock,
+  // so the destructor, which waits for read_in_flight to clear, can not free
+  // the reader while the task still uses it.
+  void pooled_read() {
+    bool terminating = termination_requested.load();
+    if (!terminating)
+      read_block(slots[next_read % ring_size]);
+    std::lock_guard<std::mutex> lock(schedule_mutex);
+    read_in_flight = false;
+    if (!terminating) {
+      ++next_read;
+      produced.store(next_read, std::memory_order_release);
+      notify_change(produced);
+      wake_waiter();
+      submit_read_locked();
+    }
+    read_done.notify_all();
+  }
+
   std::unique_ptr<ByteSourceBase> byte_source;
+  ReadPools pools;
+  unsigned ring_size;
+  Slot slots[slot_count];
 
   std::thread worker;
 
-  bool termination_requested;
-  std::exception_ptr read_error;
-  char *buffer;
-  int desired_byte_count;
-  int read_byte_count;
+  std::atomic<unsigned> produced;
+  unsigned consumed;
+  std::atomic<unsigned> released;
+  std::atomic<bool> termination_requested;
 
-  std::mutex lock;
-  std::condition_variable read_finished_condition;
-  std::condition_variable read_requested_condition;
+  // pooled reads only
+  bool pooled_reads;
+  std::mutex schedule_mutex;
+  std::condition_variable read_done;
+  unsigned next_read; // guarded by schedule_mutex
+  bool read_in_flight; // guarded by schedule_mutex
+
+  std::mutex wake_mutex;
+  std::function<void()> pending_wake; // guarded by wake_mutex
 };
 #endif
 
@@ -268,72 +653,874 @@ class SynchronousReader {
 public:
   void init(std::unique_ptr<ByteSourceBase> arg_byte_source) {
     byte_source = std::move(arg_byte_source);
+    for (auto &buffer : buffers)
+      buffer.reset(new char[block_buffer_len]);
+    next = 0;
   }
 
-  bool is_valid() const { return byte_source != nullptr; }
-
-  void start_read(char *arg_buffer, int arg_desired_byte_count) {
-    buffer = arg_buffer;
-    desired_byte_count = arg_desired_byte_count;
+  char *next_block(int &byte_count) {
+    char *buffer = buffers[next].get();
+    next ^= 1;
+    byte_count = byte_source->read(buffer + block_len, block_len);
+    return buffer;
   }
 
-  int finish_read() { return byte_source->read(buffer, desired_byte_count); }
+  void release_block() {}
+
+  // Reads happen in next_block, there is nothing to wait for.
+  bool block_ready() const { return true; }
+
+  void when_block_ready(std::function<void()> wake) { wake(); }
 
 private:
   std::unique_ptr<ByteSourceBase> byte_source;
-  char *buffer;
-  int desired_byte_count;
+  std::unique_ptr<char[]> buffers[2];
+  int next;
 };
 } // namespace detail
 
+#if defined(__linux__) && !defined(CSV_IO_NO_THREAD)
+////////////////////////////////////////////////////////////////////////////
+//                          Batched Linux reads                           //
+////////////////////////////////////////////////////////////////////////////
+
+// A read of size bytes at offset of fd. done becomes 1 once result holds the
+// byte count or -errno.
+struct ReadRequest {
+  int fd;
+  char *buffer;
+  unsigned size;
+  long long offset;
+  int result;
+  std::atomic<unsigned> done;
+  ReadRequest *next_queued;
+};
+
+// Runs the reads of any number of files on one thread. Requests are pushed
+// onto a lock-free stack and an eventfd wakes the thread up. With io_uring the
+// thread keeps up to queue_depth reads in flight and waits for completions in
+// one system call; if io_uring is unavailable it falls back to pread.
+class ReadEngine {
+public:
+  explicit ReadEngine(unsigned queue_depth = 256) {
+    wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (wakeup_fd < 0)
+      throw std::system_error(errno, std::generic_category(), "eventfd");
+#if CSV_IO_HAS_IO_URING
+    setup_ring(queue_depth);
+#else
+    (void)queue_depth;
+#endif
+    worker = std::thread([this] {
+#if CSV_IO_HAS_IO_URING
+      if (ring_fd >= 0) {
+        run_ring();
+        return;
+      }
+#endif
+      run_pread();
+    });
+  }
+
+  ReadEngine(const ReadEngine &) = delete;
+  ReadEngine &operator=(const ReadEngine &) = delete;
+
+  // Engine used by sources that are not given one.
+  static ReadEngine &shared() {
+    static ReadEngine engine;
+    return engine;
+  }
+
+  bool uses_io_uring() const { return ring_fd >= 0; }
+
+  void submit(ReadRequest &request) {
+    request.done.store(0);
+    ReadRequest *head = queued.load(std::memory_order_relaxed);
+    do
+      request.next_queued = head;
+    while (!queued.compare_exchange_weak(head, &request,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed));
+    wake_up();
+  }
+
+  // Blocks until the request has completed and returns its result.
+  static int wait(ReadRequest &request) {
+    while (request.done.load(std::memory_order_acquire) == 0)
+      detail::wait_for_change(request.done, 0);
+    return request.result;
+  }
+
+  // All requests must have completed before the engine is destroyed.
+  ~ReadEngine() {
+    termination_requested.store(true);
+    wake_up();
+    worker.join();
+#if CSV_IO_HAS_IO_URING
+    if (ring_fd >= 0) {
+      munmap(sqes, sqe_map_len);
+      if (cq_map != sq_map)
+        munmap(cq_map, cq_map_len);
+      munmap(sq_map, sq_map_len);
+      ::close(ring_fd);
+    }
+#endif
+    ::close(wakeup_fd);
+  }
+
+private:
+  void wake_up() {
+    std::uint64_t one = 1;
+    while (::write(wakeup_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+  }
+
+  static void complete(ReadRequest &request, int result) {
+    request.result = result;
+    request.done.store(1, std::memory_order_release);
+    detail::notify_change(request.done);
+  }
+
+  // Takes everything pushed so far, oldest first.
+  void take_queued(std::vector<ReadRequest *> &pending) {
+    ReadRequest *head = queued.exchange(nullptr, std::memory_order_acquire);
+    std::size_t first = pending.size();
+    for (; head != nullptr; head = head->next_queued)
+      pending.push_back(head);
+    std::reverse(pending.begin() + first, pending.end());
+  }
+
+  void run_pread() {
+    std::vector<ReadRequest *> pending;
+    for (;;) {
+      std::uint64_t count;
+      if (::read(wakeup_fd, &count, sizeof(count)) < 0 && errno == EINTR)
+        continue;
+      take_queued(pending);
+      for (ReadRequest *request : pending) {
+        ssize_t result;
+        do
+          result = ::pread(request->fd, request->buffer, request->size,
+                           request->offset);
+        while (result < 0 && errno == EINTR);
+        complete(*request, result < 0 ? -errno : static_cast<int>(result));
+      }
+      pending.clear();
+      if (termination_requested.load())
+        return;
+    }
+  }
+
+#if CSV_IO_HAS_IO_URING
+  void setup_ring(unsigned queue_depth) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, queue_depth, &params));
+    if (ring_fd < 0)
+      return;
+    if (!supports_read()) {
+      ::close(ring_fd);
+      ring_fd = -1;
+      return;
+    }
+
+    sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+      sq_map_len = cq_map_len = (std::max)(sq_map_len, cq_map_len);
+    sqe_map_len = params.sq_entries * sizeof(io_uring_sqe);
+
+    sq_map = mmap(nullptr, sq_map_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cq_map = (params.features & IORING_FEAT_SINGLE_MMAP)
+                 ? sq_map
+                 : mmap(nullptr, cq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    void *sqe_map = mmap(nullptr, sqe_map_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq_map == MAP_FAILED || cq_map == MAP_FAILED || sqe_map == MAP_FAILED) {
+      if (sqe_map != MAP_FAILED)
+        munmap(sqe_map, sqe_map_len);
+      if (cq_map != MAP_FAILED && cq_map != sq_map)
+        munmap(cq_map, cq_map_len);
+      if (sq_map != MAP_FAILED)
+        munmap(sq_map, sq_map_len);
+      ::close(ring_fd);
+      ring_fd = -1;
+      return;
+    }
+
+    char *sq = static_cast<char *>(sq_map);
+    char *cq = static_cast<char *>(cq_map);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    sqes = static_cast<io_uring_sqe *>(sqe_map);
+  }
+
+  // Kernels before 5.6 set up rings but fail every IORING_OP_READ with EINVAL;
+  // they do not know IORING_REGISTER_PROBE either.
+  bool supports_read() {
+    const unsigned op_count = 256;
+    std::unique_ptr<char[]> memory(new char[sizeof(io_uring_probe) +
+                                            op_count * sizeof(io_uring_probe_op)]());
+    io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(memory.get());
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe,
+                op_count) < 0)
+      return false;
+    return probe->last_op >= IORING_OP_READ &&
+           (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) != 0;
+  }
+
+  // user_data 0 is the read of the wakeup eventfd, anything else a request.
+  void prepare_read(int fd, void *buffer, unsigned size, long long offset,
+                    std::uint64_t user_data) {
+    unsigned tail = *sq_tail;
+    unsigned index = tail & sq_mask;
+    io_uring_sqe &sqe = sqes[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<std::uint64_t>(buffer);
+    sqe.len = size;
+    sqe.off = static_cast<std::uint64_t>(offset);
+    sqe.user_data = user_data;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit;
+  }
+
+  void run_ring() {
+    std::vector<ReadRequest *> pending;
+    std::size_t next_pending = 0;
+    std::vector<ReadRequest *> in_flight;
+    std::uint64_t wakeup_count;
+    bool wakeup_armed = false;
+
+    for (;;) {
+      if (!wakeup_armed && !termination_requested.load()) {
+        prepare_read(wakeup_fd, &wakeup_count, sizeof(wakeup_count), 0, 0);
+        wakeup_armed = true;
+      }
+      // One slot stays reserved for re-arming the wakeup read.
+      while (next_pending != pending.size() && in_flight.size() + 1 < sq_entries) {
+        ReadRequest *request = pending[next_pending++];
+        prepare_read(request->fd, request->buffer, request->size,
+                     request->offset, reinterpret_cast<std::uint64_t>(request));
+        in_flight.push_back(request);
+      }
+      if (next_pending == pending.size()) {
+        pending.clear();
+        next_pending = 0;
+      }
+      if (termination_requested.load() && in_flight.empty())
+        return;
+
+      int entered = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                        1, IORING_ENTER_GETEVENTS, nullptr, 0));
+      if (entered >= 0)
+        to_submit -= entered;
+      else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        // The ring is unusable: fail what it holds, so the readers report
+        // can_not_read_file, and serve later requests with pread. This frame
+        // stays alive, so the wakeup read possibly still armed on the ring has
+        // its buffer; waking once makes up for a wakeup it may swallow.
+        int error = errno;
+        for (ReadRequest *request : in_flight)
+          complete(*request, -error);
+        for (; next_pending != pending.size(); ++next_pending)
+          complete(*pending[next_pending], -error);
+        wake_up();
+        run_pread();
+        return;
+      }
+
+      unsigned head = *cq_head;
+      while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        const io_uring_cqe &cqe = cqes[head & cq_mask];
+        if (cqe.user_data == 0) {
+          wakeup_armed = false;
+          take_queued(pending);
+        } else {
+          ReadRequest *request = reinterpret_cast<ReadRequest *>(cqe.user_data);
+          *std::find(in_flight.begin(), in_flight.end(), request) = in_flight.back();
+          in_flight.pop_back();
+          complete(*request, cqe.res);
+        }
+        ++head;
+      }
+      __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+  }
+
+  void *sq_map = nullptr;
+  void *cq_map = nullptr;
+  std::size_t sq_map_len = 0;
+  std::size_t cq_map_len = 0;
+  std::size_t sqe_map_len = 0;
+  unsigned *sq_tail = nullptr;
+  unsigned sq_mask = 0;
+  unsigned *sq_array = nullptr;
+  unsigned sq_entries = 0;
+  unsigned *cq_head = nullptr;
+  unsigned *cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  io_uring_cqe *cqes = nullptr;
+  io_uring_sqe *sqes = nullptr;
+  unsigned to_submit = 0;
+#endif
+
+  int ring_fd = -1;
+  int wakeup_fd;
+  std::atomic<ReadRequest *> queued{nullptr};
+  std::atomic<bool> termination_requested{false};
+  std::thread worker;
+};
+
+// Reads a file through a ReadEngine, keeping chunk_count reads of chunk_len
+// bytes in flight. With direct_io the file is opened with O_DIRECT (if the file
+// system allows it) into buffers aligned for it, which bypasses the page cache.
+class UringByteSource : public ByteSourceBase {
+public:
+  UringByteSource(const char *file_name, bool direct_io = false,
+                  ReadEngine &engine = ReadEngine::shared(),
+                  int chunk_count = 8, int chunk_len = 256 << 10)
+      : engine(engine), chunk_len(chunk_len), chunk_count(chunk_count),
+        chunks(new Chunk[chunk_count]) {
+    fd = -1;
+    if (direct_io)
+      fd = ::open(file_name, O_RDONLY | O_CLOEXEC | O_DIRECT);
+    direct = fd >= 0;
+    if (fd < 0)
+      fd = ::open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      int x = errno;
+      error::can_not_open_file err;
+      err.set_errno(x);
+      err.set_file_name(file_name);
+      throw err;
+    }
+    struct stat info;
+    file_size = ::fstat(fd, &info) == 0 ? info.st_size : -1;
+    set_file_name(file_name);
+
+    for (int i = 0; i < chunk_count; ++i) {
+      Chunk &chunk = chunks[i];
+      void *memory = nullptr;
+      if (posix_memalign(&memory, alignment, chunk_len) != 0) {
+        ::close(fd);
+        throw std::bad_alloc();
+      }
+      chunk.buffer.reset(static_cast<char *>(memory));
+      chunk.request.fd = fd;
+      chunk.request.buffer = chunk.buffer.get();
+      chunk.request.size = chunk_len;
+      chunk.request.done.store(1);
+      chunk.in_flight = false;
+    }
+    next_offset = 0;
+    current = 0;
+    current_pos = 0;
+    current_len = 0;
+    end_of_file = false;
+    for (int i = 0; i < chunk_count; ++i)
+      issue(chunks[i]);
+  }
+
+  bool reads_ahead() const override { return true; }
+
+  int read(char *buffer, int size) override {
+    int copied = 0;
+    while (copied < size) {
+      if (current_pos == current_len && !next_chunk())
+        break;
+      int n = (std::min)(size - copied, current_len - current_pos);
+      std::memcpy(buffer + copied,
+                  chunks[current].buffer.get() + current_pos, n);
+      current_pos += n;
+      copied += n;
+    }
+    return copied;
+  }
+
+  ~UringByteSource() {
+    for (int i = 0; i < chunk_count; ++i)
+      if (chunks[i].in_flight)
+        ReadEngine::wait(chunks[i].request);
+    ::close(fd);
+  }
+
+private:
+  static const std::size_t alignment = 4096;
+
+  struct free_deleter {
+    void operator()(char *p) const { std::free(p); }
+  };
+
+  struct Chunk {
+    std::unique_ptr<char, free_deleter> buffer;
+    ReadRequest request;
+    bool in_flight;
+  };
+
+  void set_file_name(const char *file_name) {
+    std::strncpy(this->file_name, file_name, sizeof(this->file_name) - 1);
+    this->file_name[sizeof(this->file_name) - 1] = '\0';
+  }
+
+  void issue(Chunk &chunk) {
+    if (file_size >= 0 && next_offset >= file_size) {
+      chunk.in_flight = false;
+      return;
+    }
+    chunk.request.offset = next_offset;
+    next_offset += chunk_len;
+    chunk.in_flight = true;
+    engine.submit(chunk.request);
+  }
+
+  // Makes the chunk with the next bytes of the file current and reissues the
+  // chunk that was consumed.
+  bool next_chunk() {
+    if (end_of_file)
+      return false;
+    Chunk &consumed = chunks[current];
+    if (current_len != 0) {
+      issue(consumed);
+      current = (current + 1) % chunk_count;
+    }
+
+    Chunk &chunk = chunks[current];
+    if (!chunk.in_flight) {
+      end_of_file = true;
+      return false;
+    }
+    int result = ReadEngine::wait(chunk.request);
+    chunk.in_flight = false;
+    if (result < 0) {
+      error::can_not_read_file err;
+      err.set_errno(-result);
+      err.set_file_name(file_name);
+      throw err;
+    }
+    // A short read before the end of the file is completed synchronously.
+    // With O_DIRECT a read has to start and end on the alignment, so the bytes
+    // after the last aligned offset are read again.
+    long long expected = chunk.request.size;
+    if (file_size >= 0)
+      expected = (std::min)(expected, file_size - chunk.request.offset);
+    const long long align = direct ? static_cast<long long>(alignment) : 1;
+    while (result < expected) {
+      long long from = result / align * align;
+      long long to = (std::min)(static_cast<long long>(chunk_len),
+                                (expected + align - 1) / align * align);
+      ssize_t more = ::pread(fd, chunk.buffer.get() + from, to - from,
+                             chunk.request.offset + from);
+      if (more < 0 && errno == EINTR)
+        continue;
+      if (more < 0) {
+        int x = errno;
+        error::can_not_read_file err;
+        err.set_errno(x);
+        err.set_file_name(file_name);
+        throw err;
+      }
+      if (from + more <= result)
+        break;
+      result = static_cast<int>(from + more);
+    }
+    if (result == 0) {
+      end_of_file = true;
+      return false;
+    }
+    current_pos = 0;
+    current_len = result;
+    return true;
+  }
+
+  ReadEngine &engine;
+  int fd;
+  bool direct; // fd was opened with O_DIRECT
+  long long file_size;
+  int chunk_len;
+  int chunk_count;
+  std::unique_ptr<Chunk[]> chunks;
+  long long next_offset;
+  int current;
+  int current_pos;
+  int current_len;
+  bool end_of_file;
+  char file_name[error::max_file_name_length + 1];
+};
+
+inline std::unique_ptr<ByteSourceBase>
+open_uring_byte_source(const char *file_name, bool direct_io = false) {
+  return std::unique_ptr<ByteSourceBase>(
+      new UringByteSource(file_name, direct_io));
+}
+#endif
+
+inline std::unique_ptr<ByteSourceBase>
+open_file_byte_source(const char *file_name) {
+  // We open the file in binary mode as it makes no difference under *nix
+  // and under Windows we handle \r\n newlines ourself.
+  FILE *file = std::fopen(file_name, "rb");
+  if (file == 0) {
+    int x = errno; // store errno as soon as possible, doing it after
+                   // constructor call can fail.
+    error::can_not_open_file err;
+    err.set_errno(x);
+    err.set_file_name(file_name);
+    throw err;
+  }
+  return std::unique_ptr<ByteSourceBase>(
+      new detail::OwningStdIOByteSourceBase(file));
+}
+
+////////////////////////////////////////////////////////////////////////////
+//                          Compressed input                              //
+////////////////////////////////////////////////////////////////////////////
+
+// The decompressing sources read the compressed bytes from another byte
+// source and do their work inside read, so under a LineReader they run on the
+// read-ahead thread, decompressing straight into its block buffers while the
+// parser works on earlier blocks.
+
+#ifdef CSV_IO_WITH_ZLIB
+// Inflates gzip or zlib data. Concatenated gzip members, as written by
+// parallel gzip compressors, are decompressed one after the other.
+class GzipByteSource : public ByteSourceBase {
+public:
+  GzipByteSource(const char *file_name,
+                 std::unique_ptr<ByteSourceBase> compressed)
+      : compressed(std::move(compressed)), input(new char[input_len]) {
+    std::memset(&stream, 0, sizeof(stream));
+    // 15 window bits, +32 detects the gzip or zlib header
+    if (inflateInit2(&stream, 15 + 32) != Z_OK)
+      throw std::bad_alloc();
+    err.set_file_name(file_name);
+    input_exhausted = false;
+    in_member = false;
+  }
+
+  int read(char *buffer, int size) override {
+    stream.next_out = reinterpret_cast<Bytef *>(buffer);
+    stream.avail_out = size;
+    while (stream.avail_out != 0) {
+      if (stream.avail_in == 0 && !input_exhausted) {
+        int byte_count = compressed->read(input.get(), input_len);
+        input_exhausted = byte_count == 0;
+        stream.next_in = reinterpret_cast<Bytef *>(input.get());
+        stream.avail_in = byte_count;
+      }
+      if (stream.avail_in == 0 && input_exhausted) {
+        if (in_member)
+          throw err; // truncated
+        break;
+      }
+
+      int status = inflate(&stream, Z_NO_FLUSH);
+      if (status == Z_STREAM_END) {
+        in_member = false;
+        inflateReset(&stream);
+      } else if (status == Z_OK) {
+        in_member = true;
+      } else if (status != Z_BUF_ERROR) {
+        throw err;
+      }
+    }
+    return size - static_cast<int>(stream.avail_out);
+  }
+
+  ~GzipByteSource() { inflateEnd(&stream); }
+
+private:
+  static const int input_len = 1 << 18;
+
+  std::unique_ptr<ByteSourceBase> compressed;
+  std::unique_ptr<char[]> input;
+  z_stream stream;
+  bool input_exhausted;
+  bool in_member;
+  error::corrupt_compressed_file err;
+};
+
+inline std::unique_ptr<ByteSourceBase>
+open_gzip_byte_source(const char *file_name,
+                      std::unique_ptr<ByteSourceBase> compressed) {
+  return std::unique_ptr<ByteSourceBase>(
+      new GzipByteSource(file_name, std::move(compressed)));
+}
+#endif
+
+#ifdef CSV_IO_WITH_ZSTD
+// Decompresses zstd data. Frames that store their decompressed size in the
+// header, as written by pzstd, zstd -B or the seekable format, and that are not
+// larger than max_parallel_frame_len are decompressed in parallel, up to
+// parallelism frames ahead of the reader. All other frames are streamed.
+class ZstdByteSource : public ByteSourceBase {
+public:
+  ZstdByteSource(const char *file_name,
+                 std::unique_ptr<ByteSourceBase> compressed,
+                 unsigned parallelism = default_parallelism())
+      : compressed(std::move(compressed)),
+        parallelism(parallelism == 0 ? 1 : parallelism) {
+    stream = ZSTD_createDStream();
+    if (stream == nullptr)
+      throw std::bad_alloc();
+    err.set_file_name(file_name);
+    input_begin = 0;
+    input_exhausted = false;
+    output_pos = 0;
+    streaming = false;
+  }
+
+  int read(char *buffer, int size) override {
+    int copied = 0;
+    while (copied < size) {
+      if (output_pos != output.size()) {
+        std::size_t n = (std::min)(static_cast<std::size_t>(size - copied),
+                                   output.size() - output_pos);
+        std::memcpy(buffer + copied, output.data() + output_pos, n);
+        output_pos += n;
+        copied += static_cast<int>(n);
+        continue;
+      }
+      if (streaming) {
+        if (input_begin == input.size() && !read_input())
+          throw err; // truncated
+        ZSTD_inBuffer in = {input.data() + input_begin,
+                            input.size() - input_begin, 0};
+        ZSTD_outBuffer out = {buffer + copied,
+                              static_cast<std::size_t>(size - copied), 0};
+        std::size_t status = ZSTD_decompressStream(stream, &out, &in);
+        if (ZSTD_isError(status))
+          throw err;
+        input_begin += in.pos;
+        copied += static_cast<int>(out.pos);
+        if (status == 0)
+          streaming = false;
+        continue;
+      }
+
+      schedule_frames();
+      if (!frames.empty()) {
+        output = frames.front().get();
+        frames.pop_front();
+        output_pos = 0;
+      } else if (!streaming) {
+        break;
+      }
+    }
+    return copied;
+  }
+
+  ~ZstdByteSource() {
+    // wait for the decoders before the buffers go away
+    for (auto &frame : frames)
+      frame.wait();
+    ZSTD_freeDStream(stream);
+  }
+
+private:
+  static const std::size_t input_chunk_len = 1 << 20;
+  static const unsigned long long max_parallel_frame_len = 64ull << 20;
+  // ZSTD_FRAMEHEADERSIZE_MAX, which zstd.h only exports for static linking
+  static const std::size_t max_frame_header_len = 18;
+
+  static unsigned default_parallelism() {
+#ifdef CSV_IO_NO_THREAD
+    return 1;
+#else
+    return (std::max)(1u, std::thread::hardware_concurrency());
+#endif
+  }
+
+  // Appends the next compressed bytes to input. Returns false at the end.
+  bool read_input() {
+    if (input_exhausted)
+      return false;
+    input.erase(input.begin(), input.begin() + input_begin);
+    input_begin = 0;
+    std::size_t old_len = input.size();
+    input.resize(old_len + input_chunk_len);
+    int byte_count =
+        compressed->read(input.data() + old_len, static_cast<int>(input_chunk_len));
+    input.resize(old_len + byte_count);
+    input_exhausted = byte_count == 0;
+    return byte_count != 0;
+  }
+
+  // Starts decoding the frames that follow in parallel until parallelism
+  // frames are queued. A frame that has to be streamed is only started once
+  // the queue has drained.
+  void schedule_frames() {
+    while (frames.size() < parallelism) {
+      std::size_t available = input.size() - input_begin;
+      if (available == 0 && !read_input())
+        return;
+      unsigned long long content_len;
+      while ((content_len = ZSTD_getFrameContentSize(
+                  input.data() + input_begin, input.size() - input_begin)) ==
+             ZSTD_CONTENTSIZE_ERROR) {
+        if (input.size() - input_begin >= max_frame_header_len ||
+            !read_input())
+          throw err;
+      }
+
+      if (content_len == ZSTD_CONTENTSIZE_UNKNOWN ||
+          content_len > max_parallel_frame_len) {
+        if (frames.empty()) {
+          ZSTD_DCtx_reset(stream, ZSTD_reset_session_only);
+          streaming = true;
+        }
+        return;
+      }
+
+      std::size_t frame_len;
+      while (ZSTD_isError(frame_len = ZSTD_findFrameCompressedSize(
+                              input.data() + input_begin,
+                              input.size() - input_begin)))
+        if (!read_input())
+          throw err;
+
+      std::vector<char> frame(input.begin() + input_begin,
+                              input.begin() + input_begin + frame_len);
+      input_begin += frame_len;
+      error::corrupt_compressed_file frame_err = err;
+      frames.push_back(std::async(
+#ifdef CSV_IO_NO_THREAD
+          std::launch::deferred,
+#else
+          std::launch::async,
+#endif
+          [content_len, frame_err](std::vector<char> frame) {
+            std::vector<char> decoded(static_cast<std::size_t>(content_len));
+            std::size_t len = ZSTD_decompress(decoded.data(), decoded.size(),
+                                              frame.data(), frame.size());
+            if (ZSTD_isError(len) || len != decoded.size())
+              throw frame_err;
+            return decoded;
+          },
+          std::move(frame)));
+    }
+  }
+
+  std::unique_ptr<ByteSourceBase> compressed;
+  unsigned parallelism;
+  ZSTD_DStream *stream;
+  error::corrupt_compressed_file err;
+
+  std::vector<char> input;
+  std::size_t input_begin;
+  bool input_exhausted;
+
+  std::deque<std::future<std::vector<char>>> frames;
+  std::vector<char> output;
+  std::size_t output_pos;
+  bool streaming;
+};
+
+inline std::unique_ptr<ByteSourceBase>
+open_zstd_byte_source(const char *file_name,
+                      std::unique_ptr<ByteSourceBase> compressed) {
+  return std::unique_ptr<ByteSourceBase>(
+      new ZstdByteSource(file_name, std::move(compressed)));
+}
+#endif
+
 class LineReader {
 private:
-  static const int block_len = 1 << 20;
-  std::unique_ptr<char[]> buffer; // must be constructed before (and thus
-                                  // destructed after) the reader!
+  static const int block_len = detail::block_len;
 #ifdef CSV_IO_NO_THREAD
   detail::SynchronousReader reader;
 #else
   detail::AsynchronousReader reader;
 #endif
+  char *buffer; // block buffer owned by the reader
   int data_begin;
   int data_end;
+  int last_newline; // position of the last '\n' in [data_begin, data_end), -1 if none
+  bool input_exhausted;
+  std::uint64_t bytes_read; // bytes the byte source has delivered so far
 
   char file_name[error::max_file_name_length + 1];
   unsigned file_line;
 
   static std::unique_ptr<ByteSourceBase> open_file(const char *file_name) {
-    // We open the file in binary mode as it makes no difference under *nix
-    // and under Windows we handle \r\n newlines ourself.
-    FILE *file = std::fopen(file_name, "rb");
-    if (file == 0) {
-      int x = errno; // store errno as soon as possible, doing it after
-                     // constructor call can fail.
-      error::can_not_open_file err;
-      err.set_errno(x);
-      err.set_file_name(file_name);
-      throw err;
-    }
-    return std::unique_ptr<ByteSourceBase>(
-        new detail::OwningStdIOByteSourceBase(file));
+    return open_file_byte_source(file_name);
   }
 
+#ifdef CSV_IO_NO_THREAD
   void init(std::unique_ptr<ByteSourceBase> byte_source) {
     file_line = 0;
 
-    buffer = std::unique_ptr<char[]>(new char[3 * block_len]);
-    data_begin = 0;
-    data_end = byte_source->read(buffer.get(), 2 * block_len);
+    reader.init(std::move(byte_source));
+#else
+  void init(std::unique_ptr<ByteSourceBase> byte_source,
+            ReadPools pools = ReadPools()) {
+    file_line = 0;
+
+    reader.init(std::move(byte_source), pools);
+#endif
+    int byte_count;
+    buffer = reader.next_block(byte_count);
+    CSV_IO_TRACE_COUNT("csv bytes read", byte_count);
+    bytes_read = byte_count;
+    data_begin = block_len;
+    data_end = block_len + byte_count;
+    input_exhausted = byte_count == 0;
+    find_last_newline();
 
     // Ignore UTF-8 BOM
-    if (data_end >= 3 && buffer[0] == '\xEF' && buffer[1] == '\xBB' &&
-        buffer[2] == '\xBF')
-      data_begin = 3;
+    if (byte_count >= 3 && buffer[block_len] == '\xEF' &&
+        buffer[block_len + 1] == '\xBB' && buffer[block_len + 2] == '\xBF')
+      data_begin += 3;
+  }
 
-    if (data_end == 2 * block_len) {
-      reader.init(std::move(byte_source));
-      reader.start_read(buffer.get() + 2 * block_len, block_len);
+  // Moves the unfinished line [data_begin, data_end) in front of the next
+  // block. Returns false if there is no more input.
+  bool next_block() {
+    if (input_exhausted)
+      return false;
+    CSV_IO_TRACE_SCOPE("csv next_block");
+
+    int carried = data_end - data_begin;
+    if (carried >= block_len) {
+      error::line_length_limit_exceeded err;
+      err.set_file_name(file_name);
+      err.set_file_line(file_line);
+      throw err;
     }
+
+    int byte_count;
+    char *next = reader.next_block(byte_count);
+    CSV_IO_TRACE_COUNT("csv bytes read", byte_count);
+    if (byte_count == 0) {
+      input_exhausted = true;
+      return false;
+    }
+    bytes_read += byte_count;
+    std::memcpy(next + block_len - carried, buffer + data_begin, carried);
+    reader.release_block();
+    buffer = next;
+    data_begin = block_len - carried;
+    data_end = block_len + byte_count;
+    find_last_newline();
+    return true;
+  }
+
+  void find_last_newline() {
+    last_newline = data_end - 1;
+    while (last_newline >= data_begin && buffer[last_newline] != '\n')
+      --last_newline;
+    if (last_newline < data_begin)
+      last_newline = -1;
   }
 
 public:
@@ -377,6 +1564,30 @@ public:
         data_begin, data_end - data_begin)));
   }
 
+#ifndef CSV_IO_NO_THREAD
+  // Readers constructed with pools share their block buffers and read-ahead
+  // threads, see ReadPools.
+  LineReader(const char *file_name,
+             std::unique_ptr<ByteSourceBase> byte_source, ReadPools pools) {
+    set_file_name(file_name);
+    init(std::move(byte_source), pools);
+  }
+
+  LineReader(const std::string &file_name,
+             std::unique_ptr<ByteSourceBase> byte_source, ReadPools pools) {
+    set_file_name(file_name.c_str());
+    init(std::move(byte_source), pools);
+  }
+
+  LineReader(const std::string &file_name, const char *data_begin,
+             const char *data_end, ReadPools pools) {
+    set_file_name(file_name.c_str());
+    init(std::unique_ptr<ByteSourceBase>(new detail::NonOwningStringByteSource(
+             data_begin, data_end - data_begin)),
+         pools);
+  }
+#endif
+
   LineReader(const char *file_name, FILE *file) {
     set_file_name(file_name);
     init(std::unique_ptr<ByteSourceBase>(
@@ -420,30 +1631,49 @@ public:
 
   unsigned get_file_line() const { return file_line; }
 
+  // Offset in the byte source of the first byte next_line has not returned
+  // yet, i.e. where the next line starts.
+  std::uint64_t get_byte_offset() const {
+    return bytes_read - (data_end - data_begin);
+  }
+
+  // True if next_line returns without waiting for the byte source: the line
+  // ends in the current block, or the next block has been read ahead.
+  bool line_ready() const {
+    return data_begin <= last_newline || input_exhausted ||
+           reader.block_ready();
+  }
+
+  // Calls wake once line_ready is true, right away if it already is, else on
+  // the thread that completes the read. wake must not call into the reader.
+  void when_line_ready(std::function<void()> wake) {
+    if (line_ready())
+      wake();
+    else
+      reader.when_block_ready(std::move(wake));
+  }
+
   char *next_line() {
-    if (data_begin == data_end)
+    CSV_IO_TRACE_SCOPE("csv next_line");
+    if (data_begin == data_end && !next_block())
       return nullptr;
 
     ++file_line;
 
     assert(data_begin < data_end);
-    assert(data_end <= block_len * 2);
-
-    if (data_begin >= block_len) {
-      std::memcpy(buffer.get(), buffer.get() + block_len, block_len);
-      data_begin -= block_len;
-      data_end -= block_len;
-      if (reader.is_valid()) {
-        data_end += reader.finish_read();
-        std::memcpy(buffer.get() + block_len, buffer.get() + 2 * block_len,
-                    block_len);
-        reader.start_read(buffer.get() + 2 * block_len, block_len);
-      }
-    }
+    assert(data_end <= 2 * block_len);
 
     int line_end = data_begin;
-    while (line_end != data_end && buffer[line_end] != '\n') {
-      ++line_end;
+    for (;;) {
+      while (line_end != data_end && buffer[line_end] != '\n') {
+        ++line_end;
+      }
+      if (line_end != data_end)
+        break;
+      int scanned = line_end - data_begin;
+      if (!next_block())
+        break;
+      line_end = data_begin + scanned;
     }
 
     if (line_end - data_begin + 1 > block_len) {
@@ -466,7 +1696,7 @@ public:
     if (line_end != data_begin && buffer[line_end - 1] == '\r')
       buffer[line_end - 1] = '\0';
 
-    char *ret = buffer.get() + data_begin;
+    char *ret = buffer + data_begin;
     data_begin = line_end + 1;
     return ret;
   }
@@ -783,7 +2013,29 @@ struct set_to_max_on_overflow {
   }
 };
 
+// Passed to read_row in place of a variable for a column the caller does not
+// need. The column is only split off the line: it is neither trimmed nor
+// unescaped and no bytes of it are copied.
+struct skip_column {};
+
+// Passed to read_row for a column whose text is wanted as it is in the file.
+// value points to the untrimmed text, quotes and doubled quotes are kept. It is
+// valid until the next call to read_row.
+struct raw_column {
+  const char *value = nullptr;
+};
+
 namespace detail {
+template <class T> struct is_unprocessed_column {
+  static const bool value = false;
+};
+template <> struct is_unprocessed_column<skip_column> {
+  static const bool value = true;
+};
+template <> struct is_unprocessed_column<raw_column> {
+  static const bool value = true;
+};
+
 template <class quote_policy>
 void chop_next_column(char *&line, char *&col_begin, char *&col_end) {
   assert(line != nullptr);
@@ -801,9 +2053,11 @@ void chop_next_column(char *&line, char *&col_begin, char *&col_end) {
   }
 }
 
+// unprocessed[i] tells whether the i-th sorted column is a skip_column or
+// raw_column, which are neither trimmed nor unescaped.
 template <class trim_policy, class quote_policy>
 void parse_line(char *line, char **sorted_col,
-                const std::vector<int> &col_order) {
+                const std::vector<int> &col_order, const bool *unprocessed) {
   for (int i : col_order) {
     if (line == nullptr)
       throw ::io::error::too_few_columns();
@@ -811,8 +2065,10 @@ void parse_line(char *line, char **sorted_col,
     chop_next_column<quote_policy>(line, col_begin, col_end);
 
     if (i != -1) {
-      trim_policy::trim(col_begin, col_end);
-      quote_policy::unescape(col_begin, col_end);
+      if (!unprocessed[i]) {
+        trim_policy::trim(col_begin, col_end);
+        quote_policy::unescape(col_begin, col_end);
+      }
 
       sorted_col[i] = col_begin;
     }
@@ -821,6 +2077,34 @@ void parse_line(char *line, char **sorted_col,
     throw ::io::error::too_many_columns();
 }
 
+// Same as parse_line for files whose columns are in the order of the read_row
+// arguments ColType. The recursion is unrolled at compile time, which removes
+// the col_order lookup and decides per column type whether to trim and
+// unescape.
+template <class trim_policy, class quote_policy>
+void parse_line_in_order(char *line, char **) {
+  if (line != nullptr)
+    throw ::io::error::too_many_columns();
+}
+
+template <class trim_policy, class quote_policy, class ColType,
+          class... OtherColTypes>
+void parse_line_in_order(char *line, char **sorted_col) {
+  if (line == nullptr)
+    throw ::io::error::too_few_columns();
+  char *col_begin, *col_end;
+  chop_next_column<quote_policy>(line, col_begin, col_end);
+
+  if (!is_unprocessed_column<ColType>::value) {
+    trim_policy::trim(col_begin, col_end);
+    quote_policy::unescape(col_begin, col_end);
+  }
+  *sorted_col = col_begin;
+
+  parse_line_in_order<trim_policy, quote_policy, OtherColTypes...>(
+      line, sorted_col + 1);
+}
+
 template <unsigned column_count, class trim_policy, class quote_policy>
 void parse_header_line(char *line, std::vector<int> &col_order,
                        const std::string *col_name,
@@ -888,8 +2172,15 @@ template <class overflow_policy> void parse(char *col, const char *&x) {
 
 template <class overflow_policy> void parse(char *col, char *&x) { x = col; }
 
+template <class overflow_policy> void parse(char *, skip_column &) {}
+
+template <class overflow_policy> void parse(char *col, raw_column &x) {
+  x.value = col;
+}
+
+// Checks one digit at a time whether the next digit would overflow T.
 template <class overflow_policy, class T>
-void parse_unsigned_integer(const char *col, T &x) {
+void parse_unsigned_integer_checked(const char *col, T &x) {
   x = 0;
   while (*col != '\0') {
     if ('0' <= *col && *col <= '9') {
@@ -905,6 +2196,65 @@ void parse_unsigned_integer(const char *col, T &x) {
   }
 }
 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ||    \
+    defined(_M_X64) || defined(_M_IX86) || defined(_M_ARM64)
+#define CSV_IO_SWAR_DIGITS 1
+
+// Checks that the 8 bytes in chunk (in memory order) are all '0'-'9'.
+inline bool are_8_digits(std::uint64_t chunk) {
+  return ((chunk & 0xF0F0F0F0F0F0F0F0ull) |
+          (((chunk + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4)) ==
+         0x3333333333333333ull;
+}
+
+// The value of the 8 digits in chunk, combining pairs, then quadruples of
+// digits with three multiplications instead of eight.
+inline std::uint32_t parse_8_digits(std::uint64_t chunk) {
+  const std::uint64_t mask = 0x000000FF000000FFull;
+  const std::uint64_t mul1 = 100 + (1000000ull << 32);
+  const std::uint64_t mul2 = 1 + (10000ull << 32);
+  chunk -= 0x3030303030303030ull;
+  chunk = (chunk * 10) + (chunk >> 8);
+  return static_cast<std::uint32_t>(
+      (((chunk & mask) * mul1) + (((chunk >> 16) & mask) * mul2)) >> 32);
+}
+#endif
+
+// The value of the length decimal digits at col, which can not overflow
+// std::uint64_t as length is at most 19. Throws no_digit on anything else.
+inline std::uint64_t parse_short_digit_sequence(const char *col,
+                                                std::size_t length) {
+  std::uint64_t value = 0;
+#ifdef CSV_IO_SWAR_DIGITS
+  for (; length >= 8; length -= 8, col += 8) {
+    std::uint64_t chunk;
+    std::memcpy(&chunk, col, 8);
+    if (!are_8_digits(chunk))
+      throw error::no_digit();
+    value = value * 100000000 + parse_8_digits(chunk);
+  }
+#endif
+  for (; length != 0; --length, ++col) {
+    unsigned digit = static_cast<unsigned char>(*col) - '0';
+    if (digit > 9)
+      throw error::no_digit();
+    value = value * 10 + digit;
+  }
+  return value;
+}
+
+template <class overflow_policy, class T>
+void parse_unsigned_integer(const char *col, T &x) {
+  // Numbers with at most digits10 digits can not overflow T, parse them
+  // without the per digit check.
+  std::size_t length = std::strlen(col);
+  if (length <= static_cast<std::size_t>(std::numeric_limits<T>::digits10) &&
+      length <= 19)
+    x = static_cast<T>(parse_short_digit_sequence(col, length));
+  else
+    parse_unsigned_integer_checked<overflow_policy>(col, x);
+}
+
 template <class overflow_policy> void parse(char *col, unsigned char &x) {
   parse_unsigned_integer<overflow_policy>(col, x);
 }
@@ -926,6 +2276,14 @@ void parse_signed_integer(const char *col, T &x) {
   if (*col == '-') {
     ++col;
 
+    std::size_t length = std::strlen(col);
+    if (length <= static_cast<std::size_t>(std::numeric_limits<T>::digits10) &&
+        length <= 18) {
+      x = static_cast<T>(
+          -static_cast<long long>(parse_short_digit_sequence(col, length)));
+      return;
+    }
+
     x = 0;
     while (*col != '\0') {
       if ('0' <= *col && *col <= '9') {
@@ -961,7 +2319,9 @@ template <class overflow_policy> void parse(char *col, signed long long &x) {
   parse_signed_integer<overflow_policy>(col, x);
 }
 
-template <class T> void parse_float(const char *col, T &x) {
+// Accumulates the digits one by one, which is not correctly rounded. Used where
+// std::from_chars can not parse floating point numbers.
+template <class T> void parse_float_digit_by_digit(const char *col, T &x) {
   bool is_neg = false;
   if (*col == '-') {
     is_neg = true;
@@ -1023,6 +2383,50 @@ template <class T> void parse_float(const char *col, T &x) {
     x = -x;
 }
 
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+#define CSV_IO_FROM_CHARS_FLOAT 1
+#endif
+
+// Parses [-+]digits[(.|,)digits][(e|E)[-+]digits] correctly rounded.
+template <class T> void parse_float(const char *col, T &x) {
+#ifdef CSV_IO_FROM_CHARS_FLOAT
+  const char *begin = col;
+  bool is_neg = false;
+  if (*begin == '-') {
+    is_neg = true;
+    ++begin;
+  } else if (*begin == '+')
+    ++begin;
+  const char *end = begin + std::strlen(begin);
+
+  // from_chars only knows '.' as decimal separator.
+  char number[64];
+  const char *comma =
+      static_cast<const char *>(std::memchr(begin, ',', end - begin));
+  if (comma != nullptr &&
+      end - begin < static_cast<std::ptrdiff_t>(sizeof(number))) {
+    std::memcpy(number, begin, end - begin);
+    number[comma - begin] = '.';
+    end = number + (end - begin);
+    begin = number;
+  }
+
+  // Everything from_chars rejects or can not represent, but also "inf" and
+  // "nan" which it accepts, goes to the digit by digit parser. It either
+  // throws no_digit or handles the corner cases such as an empty column or a
+  // dangling exponent the way it always did.
+  if (('0' <= *begin && *begin <= '9') || *begin == '.') {
+    std::from_chars_result result = std::from_chars(begin, end, x);
+    if (result.ec == std::errc() && result.ptr == end) {
+      if (is_neg)
+        x = -x;
+      return;
+    }
+  }
+#endif
+  parse_float_digit_by_digit(col, x);
+}
+
 template <class overflow_policy> void parse(char *col, float &x) {
   parse_float(col, x);
 }
@@ -1042,7 +2446,8 @@ template <class overflow_policy, class T> void parse(char *col, T &x) {
   // this strange construct is used.
   static_assert(sizeof(T) != sizeof(T),
                 "Can not parse this type. Only builtin integrals, floats, "
-                "char, char*, const char* and std::string are supported");
+                "char, char*, const char*, std::string, skip_column and "
+                "raw_column are supported");
 }
 
 } // namespace detail
@@ -1059,6 +2464,15 @@ private:
   std::string column_names[column_count];
 
   std::vector<int> col_order;
+  // Whether col_order is 0, 1, ..., column_count-1, in which case rows are
+  // split by parse_line_in_order.
+  bool columns_in_order;
+
+  void detect_column_order() {
+    columns_in_order = col_order.size() == column_count;
+    for (unsigned i = 0; columns_in_order && i < column_count; ++i)
+      columns_in_order = col_order[i] == static_cast<int>(i);
+  }
 
   template <class... ColNames>
   void set_column_names(std::string s, ColNames... cols) {
@@ -1074,7 +2488,8 @@ public:
   CSVReader &operator=(const CSVReader &);
 
   template <class... Args>
-  explicit CSVReader(Args &&... args) : in(std::forward<Args>(args)...) {
+  explicit CSVReader(Args &&... args)
+      : in(std::forward<Args>(args)...), columns_in_order(true) {
     std::fill(row, row + column_count, nullptr);
     col_order.resize(column_count);
     for (unsigned i = 0; i < column_count; ++i)
@@ -1093,6 +2508,7 @@ public:
                   "too many column names specified");
     try {
       set_column_names(std::forward<ColNames>(cols)...);
+      columns_in_order = false;
 
       char *line;
       do {
@@ -1103,6 +2519,7 @@ public:
 
       detail::parse_header_line<column_count, trim_policy, quote_policy>(
           line, col_order, column_names, ignore_policy);
+      detect_column_order();
     } catch (error::with_file_name &err) {
       err.set_file_name(in.get_truncated_file_name());
       throw;
@@ -1119,6 +2536,7 @@ public:
     col_order.resize(column_count);
     for (unsigned i = 0; i < column_count; ++i)
       col_order[i] = i;
+    columns_in_order = true;
   }
 
   bool has_column(const std::string &name) const {
@@ -1143,6 +2561,16 @@ public:
 
   unsigned get_file_line() const { return in.get_file_line(); }
 
+  std::uint64_t get_byte_offset() const { return in.get_byte_offset(); }
+
+  // True if read_row returns without waiting for the byte source.
+  bool row_ready() const { return in.line_ready(); }
+
+  // Calls wake once row_ready is true, see LineReader::when_line_ready.
+  void when_row_ready(std::function<void()> wake) {
+    in.when_line_ready(std::move(wake));
+  }
+
 private:
   void parse_helper(std::size_t) {}
 
@@ -1164,6 +2592,27 @@ private:
     parse_helper(r + 1, cols...);
   }
 
+  template <class... ColType> void split_line(char *line) {
+    CSV_IO_TRACE_SCOPE("csv parse_line");
+    if (columns_in_order)
+      detail::parse_line_in_order<trim_policy, quote_policy, ColType...>(line,
+                                                                          row);
+    else {
+      static const bool unprocessed[] = {
+          detail::is_unprocessed_column<ColType>::value...};
+      detail::parse_line<trim_policy, quote_policy>(line, row, col_order,
+                                                    unprocessed);
+    }
+  }
+
+  template <class T> static T &row_element(T *col, std::size_t n) {
+    return col[n];
+  }
+
+  static skip_column &row_element(skip_column *col, std::size_t) {
+    return *col;
+  }
+
 public:
   template <class... ColType> bool read_row(ColType &... cols) {
     static_assert(sizeof...(ColType) >= column_count,
@@ -1180,9 +2629,70 @@ public:
             return false;
         } while (comment_policy::is_comment(line));
 
-        detail::parse_line<trim_policy, quote_policy>(line, row, col_order);
+        split_line<ColType...>(line);
 
         parse_helper(0, cols...);
+        CSV_IO_TRACE_COUNT("csv rows parsed", 1);
+      } catch (error::with_file_name &err) {
+        err.set_file_name(in.get_truncated_file_name());
+        throw;
+      }
+    } catch (error::with_file_line &err) {
+      err.set_file_line(in.get_file_line());
+      throw;
+    }
+
+    return true;
+  }
+
+  // Reads up to max_row_count rows, the n-th of them into cols[n] of every
+  // column array. A skip_column array may have a single element. row_count is
+  // set to the number of rows read, which is below max_row_count only at the
+  // end of the file. Returns false if there was no row left. If a row can not
+  // be parsed, row_count holds the number of complete rows before it when the
+  // exception is thrown.
+  template <class... ColType>
+  bool read_rows(std::size_t max_row_count, std::size_t &row_count,
+                 ColType *... cols) {
+    return read_rows_impl(false, max_row_count, row_count, cols...);
+  }
+
+  // Like read_rows, but also stops before a row that would wait for the byte
+  // source, so row_count may be below max_row_count before the end of the
+  // file. Returns false only if there was no row left.
+  template <class... ColType>
+  bool read_ready_rows(std::size_t max_row_count, std::size_t &row_count,
+                       ColType *... cols) {
+    return read_rows_impl(true, max_row_count, row_count, cols...);
+  }
+
+private:
+  template <class... ColType>
+  bool read_rows_impl(bool only_ready, std::size_t max_row_count,
+                      std::size_t &row_count, ColType *... cols) {
+    static_assert(sizeof...(ColType) >= column_count,
+                  "not enough columns specified");
+    static_assert(sizeof...(ColType) <= column_count,
+                  "too many columns specified");
+    row_count = 0;
+    try {
+      try {
+        while (row_count < max_row_count) {
+          if (only_ready && !in.line_ready())
+            return true;
+          char *line;
+          do {
+            line = in.next_line();
+            if (!line)
+              return row_count != 0;
+          } while (comment_policy::is_comment(line));
+
+          split_line<ColType...>(line);
+
+          parse_helper(0, row_element(cols, row_count)...);
+          ++row_count;
+          CSV_IO_TRACE_COUNT("csv rows parsed", 1);
+        }
       } catch (error::with_file_name &err) {
         err.set_file_name(in.get_truncated_file_name());
         throw;
@@ -1195,5 +2705,125 @@ public:
     return true;
   }
 };
+
+#if CSV_IO_HAS_COROUTINES
+////////////////////////////////////////////////////////////////////////////
+//                               Coroutines                               //
+////////////////////////////////////////////////////////////////////////////
+
+// A coroutine that hands out values with co_yield, read with a range-based
+// for. The coroutine runs only while the loop asks for the next value, and an
+// exception it throws comes out of the loop.
+template <class T> class generator {
+public:
+  using value_type = std::remove_reference_t<T>;
+
+  struct promise_type {
+    value_type *current = nullptr;
+    std::exception_ptr error;
+
+    generator get_return_object() {
+      return generator(
+          std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    std::suspend_always yield_value(value_type &value) noexcept {
+      current = std::addressof(value);
+      return {};
+    }
+    std::suspend_always yield_value(value_type &&value) noexcept {
+      current = std::addressof(value);
+      return {};
+    }
+    void return_void() {}
+    void unhandled_exception() { error = std::current_exception(); }
+  };
+
+  class iterator {
+  public:
+    explicit iterator(std::coroutine_handle<promise_type> coroutine)
+        : coroutine(coroutine) {}
+    value_type &operator*() const { return *coroutine.promise().current; }
+    iterator &operator++() {
+      resume(coroutine);
+      return *this;
+    }
+    bool operator==(std::default_sentinel_t) const { return coroutine.done(); }
+
+  private:
+    std::coroutine_handle<promise_type> coroutine;
+  };
+
+  generator(generator &&other) noexcept
+      : coroutine(std::exchange(other.coroutine, nullptr)) {}
+  generator &operator=(generator other) noexcept {
+    std::swap(coroutine, other.coroutine);
+    return *this;
+  }
+  ~generator() {
+    if (coroutine)
+      coroutine.destroy();
+  }
+
+  iterator begin() {
+    resume(coroutine);
+    return iterator(coroutine);
+  }
+  std::default_sentinel_t end() const { return {}; }
+
+private:
+  explicit generator(std::coroutine_handle<promise_type> coroutine)
+      : coroutine(coroutine) {}
+
+  static void resume(std::coroutine_handle<promise_type> coroutine) {
+    coroutine.resume();
+    if (coroutine.promise().error)
+      std::rethrow_exception(std::exchange(coroutine.promise().error, nullptr));
+  }
+
+  std::coroutine_handle<promise_type> coroutine;
+};
+
+// Yields the rows of reader in batches, one batch object refilled each time:
+// read(reader, batch) reads the next rows into batch, false once there are
+// none, the way CSVReader::read_rows does. The reader has to outlive the
+// generator.
+template <class Batch, class Reader, class Read>
+generator<Batch &> row_batches(Reader &reader, Read read) {
+  Batch batch;
+  while (read(reader, batch))
+    co_yield batch;
+}
+
+// co_await row_ready(reader, schedule) suspends the coroutine until
+// reader.row_ready() is true and then calls schedule with its handle, on the
+// thread that completed the read. schedule should queue the coroutine to be
+// resumed elsewhere; resuming it right there would parse on the I/O thread and
+// call into the reader from its own callback. Does not suspend if the next row
+// is ready already.
+template <class Reader, class Schedule> class row_ready_awaiter {
+public:
+  row_ready_awaiter(Reader &reader, Schedule schedule)
+      : reader(reader), schedule(std::move(schedule)) {}
+
+  bool await_ready() const { return reader.row_ready(); }
+  void await_suspend(std::coroutine_handle<> coroutine) {
+    reader.when_row_ready(
+        [coroutine, schedule = schedule]() mutable { schedule(coroutine); });
+  }
+  void await_resume() const {}
+
+private:
+  Reader &reader;
+  Schedule schedule;
+};
+
+template <class Reader, class Schedule>
+row_ready_awaiter<Reader, Schedule> row_ready(Reader &reader,
+                                              Schedule schedule) {
+  return row_ready_awaiter<Reader, Schedule>(reader, std::move(schedule));
+}
+#endif
 } // namespace io
 #endif